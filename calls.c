@@ -1,106 +1,461 @@
+#include "stm32f4xx_hal.h"
 #include <string.h>
 
 #include "calls.h"
 
-void *_sbrk(ptrdiff_t incr);
+// Two-level segregated fit allocator (TLSF). Free blocks are kept in
+// lists by size class: first level is power of two of block size,
+// second level splits it in HEAP_SLCOUNT equal ranges. Bitmaps of
+// non-empty lists let malloc find a fitting block with two bit scans,
+// free coalesces block with its physical neighbours immediately, so
+// both take constant time. Free block at the end of the heap is
+// returned to _sbrk(). realloc resizes block in place when it can.
+
+#define HEAP_ALIGN (2 * sizeof(size_t))
+#define HEAP_SLLOG2 3
+#define HEAP_SLCOUNT (1 << HEAP_SLLOG2)
+
+// blocks smaller than HEAP_SMALLSIZE are in first level list 0,
+// second level there is HEAP_ALIGN step
+#define HEAP_FLSHIFT (HEAP_SLLOG2 + (sizeof(size_t) == 8 ? 4 : 3))
+#define HEAP_SMALLSIZE (1 << HEAP_FLSHIFT)
+
+// first level lists, HEAP_FLCOUNT 12 covers blocks up to 128kB
+#ifndef HEAP_FLCOUNT
+#define HEAP_FLCOUNT 12
+#endif
+
+#define HEAP_MAXSIZE (((size_t) HEAP_SMALLSIZE << (HEAP_FLCOUNT - 1)) - 1)
 
-struct block *freehead = NULL;
+#define HEAP_FREE 0x1
+
+void *_sbrk(ptrdiff_t incr);
 
 struct block {
+	// previous block in memory, NULL for the first one
+	struct block *prevphys;
+
+	// size of the whole block with header, HEAP_FREE flag in
+	// lowest bit
 	size_t size;
-	struct block *p;
-	struct block *n;
+
+	// free list links, only in free blocks
+	struct block *next;
+	struct block *prev;
 };
 
-void *malloc(size_t size)
+#define HEAP_HEADER (2 * sizeof(size_t))
+#define HEAP_MINBLOCK sizeof(struct block)
+
+#define blocksize(b) ((b)->size & ~HEAP_FREE)
+#define blockisfree(b) ((b)->size & HEAP_FREE)
+#define blocknext(b) ((struct block *) ((char *) (b) + blocksize(b)))
+#define blockdata(b) ((void *) ((char *) (b) + HEAP_HEADER))
+#define datablock(p) ((struct block *) ((char *) (p) - HEAP_HEADER))
+
+static struct block *Freelist[HEAP_FLCOUNT][HEAP_SLCOUNT];
+static uint32_t Flbitmap;
+static uint32_t Slbitmap[HEAP_FLCOUNT];
+
+// last block in memory, NULL when heap is empty
+static struct block *Last = NULL;
+
+static struct heapstat Stat;
+static char *Heapstart = NULL;
+
+static int heap_fls(size_t v)
+{
+	return (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(v);
+}
+
+static void heap_mapping(size_t size, int *fl, int *sl)
+{
+	int f;
+
+	if (size < HEAP_SMALLSIZE) {
+		*fl = 0;
+		*sl = size / (HEAP_SMALLSIZE / HEAP_SLCOUNT);
+
+		return;
+	}
+
+	f = heap_fls(size);
+
+	*sl = (size >> (f - HEAP_SLLOG2)) ^ HEAP_SLCOUNT;
+	*fl = f - HEAP_FLSHIFT + 1;
+}
+
+// list of free block, blocks merged past the last class are kept in
+// the last list, every block there still fits any request mapped to it
+static void heap_list(struct block *b, int *fl, int *sl)
+{
+	heap_mapping(blocksize(b), fl, sl);
+
+	if (*fl >= HEAP_FLCOUNT) {
+		*fl = HEAP_FLCOUNT - 1;
+		*sl = HEAP_SLCOUNT - 1;
+	}
+}
+
+static void heap_insert(struct block *b)
+{
+	int fl, sl;
+
+	heap_list(b, &fl, &sl);
+
+	b->prev = NULL;
+	b->next = Freelist[fl][sl];
+
+	if (b->next != NULL)
+		b->next->prev = b;
+
+	Freelist[fl][sl] = b;
+
+	Flbitmap |= 1 << fl;
+	Slbitmap[fl] |= 1 << sl;
+}
+
+static void heap_remove(struct block *b)
+{
+	int fl, sl;
+
+	heap_list(b, &fl, &sl);
+
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else {
+		Freelist[fl][sl] = b->next;
+
+		if (Freelist[fl][sl] == NULL) {
+			Slbitmap[fl] &= ~(1 << sl);
+
+			if (Slbitmap[fl] == 0)
+				Flbitmap &= ~(1 << fl);
+		}
+	}
+}
+
+// find free block of at least size bytes: round size up to the next
+// class boundary, so any block from found list fits
+static struct block *heap_find(size_t size)
+{
+	uint32_t map;
+	int fl, sl;
+
+	if (size >= HEAP_SMALLSIZE)
+		size += (1 << (heap_fls(size) - HEAP_SLLOG2)) - 1;
+
+	heap_mapping(size, &fl, &sl);
+
+	if (fl >= HEAP_FLCOUNT)
+		return NULL;
+
+	map = Slbitmap[fl] & (~0U << sl);
+
+	if (map == 0) {
+		if (fl + 1 >= HEAP_FLCOUNT)
+			return NULL;
+
+		if ((map = Flbitmap & (~0U << (fl + 1))) == 0)
+			return NULL;
+
+		fl = __builtin_ctz(map);
+		map = Slbitmap[fl];
+	}
+
+	sl = __builtin_ctz(map);
+
+	return Freelist[fl][sl];
+}
+
+// cut tail of block b after size bytes into a new free block, that
+// is not yet in any list
+static struct block *heap_split(struct block *b, size_t size)
+{
+	struct block *r;
+
+	if (blocksize(b) - size < HEAP_MINBLOCK)
+		return NULL;
+
+	r = (struct block *) ((char *) b + size);
+
+	r->prevphys = b;
+	r->size = (blocksize(b) - size) | HEAP_FREE;
+
+	b->size = size | (b->size & HEAP_FREE);
+
+	if (b == Last)
+		Last = r;
+	else
+		blocknext(r)->prevphys = r;
+
+	return r;
+}
+
+// merge block b with next block, that is free
+static void heap_merge(struct block *b)
+{
+	struct block *n;
+
+	n = blocknext(b);
+
+	b->size += blocksize(n);
+
+	if (n == Last)
+		Last = b;
+	else
+		blocknext(b)->prevphys = b;
+}
+
+// coalesce free block b with free neighbours, then put it into free
+// list or return it to _sbrk() if it is the last one
+static void heap_release(struct block *b)
 {
-	struct block *fb;
-	char *b;
+	b->size |= HEAP_FREE;
+
+	if (b != Last && blockisfree(blocknext(b))) {
+		heap_remove(blocknext(b));
+		heap_merge(b);
+	}
+
+	if (b->prevphys != NULL && blockisfree(b->prevphys)) {
+		b = b->prevphys;
+
+		heap_remove(b);
+		heap_merge(b);
+	}
+
+	if (b == Last) {
+		Last = b->prevphys;
+
+		_sbrk(-((ptrdiff_t) blocksize(b)));
+
+		return;
+	}
 
-	size += sizeof(struct block);
-	size = (size & 0xfffffff8) + 0x8;
+	heap_insert(b);
+}
 
-	fb = freehead;
-	while (fb != NULL) {
-		if (fb->size >= size) {
-			if (fb->p != NULL)
-				fb->p->n = fb->n;
-			else
-				freehead = fb->n;
+// get block of size bytes from _sbrk(), reusing free last block
+static struct block *heap_grow(size_t size)
+{
+	struct block *b;
 
-			if (fb->n != NULL)
-				fb->n->p = fb->p;
+	if (Last != NULL && blockisfree(Last)) {
+		heap_remove(Last);
 
-			return ((unsigned char *) fb + sizeof(struct block));
+		// fits, but is in the same class as request, so search,
+		// that rounds size up, skipped it
+		if (blocksize(Last) >= size)
+			return Last;
+
+		if (_sbrk(size - blocksize(Last)) == (void *) -1) {
+			heap_insert(Last);
+			return NULL;
 		}
 
-		fb = fb->n;
+		Last->size = size | HEAP_FREE;
+
+		return Last;
 	}
-		
-	if ((b = _sbrk(size)) == NULL)
+
+	if ((b = _sbrk(size)) == (void *) -1)
 		return NULL;
-	
-	*((size_t *) b) = size;
 
-	return (b + sizeof(struct block));
+	b->prevphys = Last;
+	b->size = size | HEAP_FREE;
+
+	Last = b;
+
+	return b;
+}
+
+static void heap_countalloc(size_t reqsize, size_t size)
+{
+	int i;
+
+	for (i = 0; i < HEAP_HISTSIZE - 1 && reqsize > (16 << i); ++i);
+
+	Stat.hist[i]++;
+	Stat.mallocs++;
+	Stat.livecount++;
+	Stat.livebytes += size;
+
+	if (Stat.livebytes > Stat.peakbytes)
+		Stat.peakbytes = Stat.livebytes;
+}
+
+// size of the block for size bytes of data
+static size_t heap_blocksize(size_t size)
+{
+	size = (size + HEAP_HEADER + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+
+	return (size < HEAP_MINBLOCK) ? HEAP_MINBLOCK : size;
+}
+
+void *malloc(size_t size)
+{
+	struct block *b, *r;
+	size_t reqsize;
+	uint32_t start;
+
+	if (Heapstart == NULL)
+		Heapstart = _sbrk(0);
+
+	if (size > HEAP_MAXSIZE)
+		return NULL;
+
+	reqsize = size;
+	size = heap_blocksize(size);
+
+	start = DWT->CYCCNT;
+	Stat.searches++;
+
+	if ((b = heap_find(size)) != NULL)
+		heap_remove(b);
+
+	Stat.searchcycles += DWT->CYCCNT - start;
+
+	if (b == NULL && (b = heap_grow(size)) == NULL)
+		return NULL;
+
+	b->size &= ~HEAP_FREE;
+
+	if ((r = heap_split(b, size)) != NULL)
+		heap_insert(r);
+
+	heap_countalloc(reqsize, blocksize(b));
+
+	return blockdata(b);
 }
 
 void free(void *ptr)
 {
-	struct block *fb;
+	struct block *b;
+
+	if (ptr == NULL)
+		return;
+
+	b = datablock(ptr);
+
+	Stat.frees++;
+	Stat.livecount--;
+	Stat.livebytes -= blocksize(b);
+
+	heap_release(b);
+}
+
+// resize block b to size bytes without moving it: shrink it, take
+// space from free next block or move the heap break if it is the last
+// one. Returns 0 if it's not possible.
+static int heap_resize(struct block *b, size_t size)
+{
+	struct block *n, *r;
+	size_t oldsize;
 
-	ptr -= sizeof(struct block);
+	oldsize = blocksize(b);
 
-	fb = (struct block *) ptr;
+	if (size > oldsize && b != Last) {
+		n = blocknext(b);
 
-	fb->p = NULL;
-	fb->n = freehead;
-	
-	freehead->p = fb;
+		if (!blockisfree(n))
+			return 0;
 
-	freehead = fb;
+		// merged block could be still too small, but if next
+		// block is the last one, rest can be taken from _sbrk()
+		if (oldsize + blocksize(n) < size && n != Last)
+			return 0;
 
-	for (fb = freehead; fb != NULL;) {
-		size_t sz;
-	
-		sz = *((size_t *) fb);
+		heap_remove(n);
+		heap_merge(b);
+	}
 
-		if (((char * ) fb) + sz == _sbrk(0)) {
-			if (fb->p != NULL)
-				fb->p->n = fb->n;
-			else
-				freehead = fb->n;
-			
-			if (fb->n != NULL)
-				fb->n->p = fb->p;
+	if (size > blocksize(b)) {
+		if (_sbrk(size - blocksize(b)) == (void *) -1) {
+			// give back the merged next block
+			if ((r = heap_split(b, oldsize)) != NULL)
+				heap_release(r);
 
-			fb = fb->n;
-			
-			_sbrk(-((ptrdiff_t) sz));
-		
-			continue;
+			return 0;
 		}
- 
-		fb = fb->n;
+
+		b->size = size;
 	}
+
+	if ((r = heap_split(b, size)) != NULL)
+		heap_release(r);
+
+	Stat.livebytes += blocksize(b) - oldsize;
+
+	if (Stat.livebytes > Stat.peakbytes)
+		Stat.peakbytes = Stat.livebytes;
+
+	return 1;
 }
 
 void *realloc(void *ptr, size_t size)
 {
-	void *old, *new;
+	void *new;
 	size_t oldsz;
 
-	new = malloc(size);
+	Stat.reallocs++;
 
-	if (ptr == NULL)
+	if (ptr != NULL && size <= HEAP_MAXSIZE
+			&& heap_resize(datablock(ptr), heap_blocksize(size))) {
+		Stat.inplace++;
+		return ptr;
+	}
+
+	if ((new = malloc(size)) == NULL || ptr == NULL)
 		return new;
 
-	old = ptr - sizeof(struct block);
-	oldsz = *((size_t *) old) - sizeof(struct block);
+	oldsz = blocksize(datablock(ptr)) - HEAP_HEADER;
 
-	memcpy(new, ptr, oldsz);
+	memcpy(new, ptr, (oldsz < size) ? oldsz : size);
 
 	free(ptr);
 
 	return new;
 }
+
+int heap_getstat(struct heapstat *st)
+{
+	struct block *b;
+	int fl, sl;
+
+	Stat.freecount = Stat.freebytes = Stat.largestfree = 0;
+
+	for (fl = 0; fl < HEAP_FLCOUNT; ++fl) {
+		for (sl = 0; sl < HEAP_SLCOUNT; ++sl) {
+			for (b = Freelist[fl][sl]; b != NULL; b = b->next) {
+				Stat.freecount++;
+				Stat.freebytes += blocksize(b);
+
+				if (blocksize(b) > Stat.largestfree)
+					Stat.largestfree = blocksize(b);
+			}
+		}
+	}
+
+	Stat.heapsize = (Heapstart != NULL)
+		? (char *) _sbrk(0) - Heapstart : 0;
+
+	memmove(st, &Stat, sizeof(struct heapstat));
+
+	return 0;
+}
+
+int heap_resetstat()
+{
+	Stat.peakbytes = Stat.livebytes;
+
+	Stat.mallocs = Stat.frees = Stat.reallocs = Stat.inplace = 0;
+	Stat.searches = Stat.searchcycles = 0;
+
+	memset(Stat.hist, 0, sizeof(Stat.hist));
+
+	return 0;
+}
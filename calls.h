@@ -2,6 +2,33 @@
 #define CALLS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+// allocation size classes: up to 16 bytes, up to 32, ...,
+// up to 4096 and bigger
+#define HEAP_HISTSIZE 10
+
+// free block search time is measured with DWT cycle counter,
+// that is enabled by trace_init()
+struct heapstat {
+	size_t heapsize;
+	size_t livebytes;
+	size_t peakbytes;
+	size_t livecount;
+	size_t freecount;
+	size_t freebytes;
+	size_t largestfree;
+	uint32_t mallocs;
+	uint32_t frees;
+	uint32_t reallocs;
+
+	// reallocs done without moving the block
+	uint32_t inplace;
+
+	uint32_t searches;
+	uint64_t searchcycles;
+	uint32_t hist[HEAP_HISTSIZE];
+};
 
 void *malloc(size_t size);
 
@@ -9,4 +36,8 @@ void free(void *ptr);
 
 void *realloc(void *ptr, size_t size);
 
+int heap_getstat(struct heapstat *st);
+
+int heap_resetstat();
+
 #endif
@@ -6,6 +6,53 @@
 
 #define DEVNAMEMAX 32
 
+enum BDEV_IOCTL {
+	BDEV_GETSTAT		= 0x01,
+	BDEV_RESETSTAT		= 0x02,
+	BDEV_BADREAD		= 0x03,
+	BDEV_GETERASECOUNT	= 0x04,
+	BDEV_SYNCWEAR		= 0x05,
+	BDEV_UNLOCK		= 0x06,
+	BDEV_LOCK		= 0x07,
+	BDEV_BUSY		= 0x08,
+	BDEV_GETCLOCK		= 0x09
+};
+
+// I/O counters, filled by BDEV_GETSTAT request. BDEV_BADREAD
+// request is used by filesystem to report, that data read from
+// address, passed as argument, failed checksum verification.
+// BDEV_GETERASECOUNT takes address and pointer to uint32_t, where
+// number of erases of sector containing that address is stored.
+// BDEV_SYNCWEAR saves erase counters kept in RAM to persistent
+// storage, if device has one.
+// BDEV_UNLOCK and BDEV_LOCK start and end a write session: device
+// stays writable between them, so program and erase calls don't
+// have to remove and restore write protection every time. Sessions
+// can be nested.
+// BDEV_BUSY returns 1 if device is still busy with program or erase,
+// so read from it would have to wait or suspend it, 0 if it's idle.
+// BDEV_GETCLOCK stores bus clock of device in Hz into uint32_t, that
+// pointer to is passed as argument.
+struct bdevstat {
+	uint32_t reads;
+	uint32_t readbytes;
+	uint32_t programs;
+	uint32_t programbytes;
+	uint32_t erases;
+	uint32_t blockerases;
+	uint32_t chiperases;
+	uint32_t busytime;
+	uint32_t retries;
+	uint32_t dmatransfers;
+	uint32_t suspends;
+};
+
+// piece of scattered buffer for readv and writev
+struct bdev_iovec {
+	void *base;
+	size_t len;
+};
+
 struct bdevice {
 	char name[DEVNAMEMAX];
 	int (*read)(void *dev, size_t addr, void *data, size_t sz);
@@ -15,13 +62,30 @@ struct bdevice {
 
 	int (*eraseall)(void *dev);
 	int (*erasesector)(void *dev, size_t addr);
+
+	// erase sz bytes at addr, both multiple of sectorsize, with
+	// the largest erase commands, that fit the range
+	int (*eraserange)(void *dev, size_t addr, size_t sz);
 	int (*writesector)(void *dev, size_t addr, const void *data,
 		size_t sz);
 
+	// read and write, that take data from iovcnt pieces instead
+	// of one buffer, as one transfer; writev, like write, can't
+	// cross writesize boundary
+	int (*readv)(void *dev, size_t addr, const struct bdev_iovec *iov,
+		int iovcnt);
+	int (*writev)(void *dev, size_t addr, const struct bdev_iovec *iov,
+		int iovcnt);
+
 	size_t writesize;
 	size_t sectorsize;
 	size_t totalsize;
 
+	// typical page program and sector erase time in us, 0 if
+	// unknown
+	uint32_t programtime;
+	uint32_t erasetime;
+
 	void *priv;
 };
 
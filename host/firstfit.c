@@ -0,0 +1,195 @@
+// First-fit allocator, that calls.c had before TLSF, kept only to
+// compare them in heapbench.
+#include "stm32f4xx_hal.h"
+#include <string.h>
+
+#include "firstfit.h"
+
+void *_sbrk(ptrdiff_t incr);
+
+static struct block *freehead = NULL;
+
+static struct heapstat Stat;
+static char *Heapstart = NULL;
+
+struct block {
+	size_t size;
+	struct block *p;
+	struct block *n;
+};
+
+static void heap_countalloc(size_t reqsize, size_t size)
+{
+	int i;
+
+	for (i = 0; i < HEAP_HISTSIZE - 1 && reqsize > (16 << i); ++i);
+
+	Stat.hist[i]++;
+	Stat.mallocs++;
+	Stat.livecount++;
+	Stat.livebytes += size;
+
+	if (Stat.livebytes > Stat.peakbytes)
+		Stat.peakbytes = Stat.livebytes;
+}
+
+void *ff_malloc(size_t size)
+{
+	struct block *fb;
+	size_t reqsize;
+	uint32_t start;
+	char *b;
+
+	if (Heapstart == NULL)
+		Heapstart = _sbrk(0);
+
+	reqsize = size;
+
+	size += sizeof(struct block);
+	size = (size & 0xfffffff8) + 0x8;
+
+	start = DWT->CYCCNT;
+	Stat.searches++;
+
+	fb = freehead;
+	while (fb != NULL) {
+		if (fb->size >= size) {
+			if (fb->p != NULL)
+				fb->p->n = fb->n;
+			else
+				freehead = fb->n;
+
+			if (fb->n != NULL)
+				fb->n->p = fb->p;
+
+			Stat.searchcycles += DWT->CYCCNT - start;
+			heap_countalloc(reqsize, fb->size);
+
+			return ((unsigned char *) fb + sizeof(struct block));
+		}
+
+		fb = fb->n;
+	}
+
+	Stat.searchcycles += DWT->CYCCNT - start;
+		
+	if ((b = _sbrk(size)) == (void *) -1)
+		return NULL;
+	
+	*((size_t *) b) = size;
+
+	heap_countalloc(reqsize, size);
+
+	return (b + sizeof(struct block));
+}
+
+void ff_free(void *ptr)
+{
+	struct block *fb;
+	uint32_t start;
+
+	if (ptr == NULL)
+		return;
+
+	ptr -= sizeof(struct block);
+
+	fb = (struct block *) ptr;
+
+	Stat.frees++;
+	Stat.livecount--;
+	Stat.livebytes -= fb->size;
+
+	fb->p = NULL;
+	fb->n = freehead;
+	
+	if (freehead != NULL)
+		freehead->p = fb;
+
+	freehead = fb;
+
+	start = DWT->CYCCNT;
+	Stat.searches++;
+
+	for (fb = freehead; fb != NULL;) {
+		size_t sz;
+	
+		sz = *((size_t *) fb);
+
+		if (((char * ) fb) + sz == _sbrk(0)) {
+			if (fb->p != NULL)
+				fb->p->n = fb->n;
+			else
+				freehead = fb->n;
+			
+			if (fb->n != NULL)
+				fb->n->p = fb->p;
+
+			fb = fb->n;
+			
+			_sbrk(-((ptrdiff_t) sz));
+		
+			continue;
+		}
+ 
+		fb = fb->n;
+	}
+
+	Stat.searchcycles += DWT->CYCCNT - start;
+}
+
+void *ff_realloc(void *ptr, size_t size)
+{
+	void *old, *new;
+	size_t oldsz;
+
+	Stat.reallocs++;
+
+	new = ff_malloc(size);
+
+	if (new == NULL || ptr == NULL)
+		return new;
+
+	old = ptr - sizeof(struct block);
+	oldsz = *((size_t *) old) - sizeof(struct block);
+
+	// block reused from free list can be bigger, than new one
+	memcpy(new, ptr, (oldsz < size) ? oldsz : size);
+
+	ff_free(ptr);
+
+	return new;
+}
+
+int ff_getstat(struct heapstat *st)
+{
+	struct block *fb;
+
+	Stat.freecount = Stat.freebytes = Stat.largestfree = 0;
+
+	for (fb = freehead; fb != NULL; fb = fb->n) {
+		Stat.freecount++;
+		Stat.freebytes += fb->size;
+
+		if (fb->size > Stat.largestfree)
+			Stat.largestfree = fb->size;
+	}
+
+	Stat.heapsize = (Heapstart != NULL)
+		? (char *) _sbrk(0) - Heapstart : 0;
+
+	memmove(st, &Stat, sizeof(struct heapstat));
+
+	return 0;
+}
+
+int ff_resetstat()
+{
+	Stat.peakbytes = Stat.livebytes;
+
+	Stat.mallocs = Stat.frees = Stat.reallocs = 0;
+	Stat.searches = Stat.searchcycles = 0;
+
+	memset(Stat.hist, 0, sizeof(Stat.hist));
+
+	return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef FIRSTFIT_H
+#define FIRSTFIT_H
+
+#include "calls.h"
+
+void *ff_malloc(size_t size);
+
+void ff_free(void *ptr);
+
+void *ff_realloc(void *ptr, size_t size);
+
+int ff_getstat(struct heapstat *st);
+
+int ff_resetstat();
+
+#endif
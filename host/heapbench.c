@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "calls.h"
+#include "firstfit.h"
+
+#define DEFAULTCOUNT 100000
+#define SLOTS 1024
+#define GROWBUFS 64
+#define GROWSTEP 64
+#define GROWMAX 4096
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+};
+
+struct benchresult {
+	uint64_t *lat;
+	size_t n;
+	size_t failed;
+	size_t live;
+	size_t peaklive;
+	size_t peakheap;
+};
+
+struct benchmark {
+	const char *name;
+	void (*run)(const struct allocator *a, size_t count);
+};
+
+void *_sbrk(ptrdiff_t incr);
+
+static struct allocator Allocators[] = {
+	{ "tlsf",	malloc,		free,		realloc },
+	{ "firstfit",	ff_malloc,	ff_free,	ff_realloc },
+	{ NULL,		NULL,		NULL,		NULL }
+};
+
+static struct benchresult Res;
+static char *Heapstart;
+static uint64_t Start;
+static uint32_t Seed = 1;
+
+static void *Slot[SLOTS];
+static size_t Slotsize[SLOTS];
+
+static uint64_t hostnow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t random32()
+{
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 17;
+	Seed ^= Seed << 5;
+
+	return Seed;
+}
+
+// sizes from lo to hi, smaller ones are more likely
+static size_t randsize(size_t lo, size_t hi)
+{
+	size_t top;
+
+	top = lo << (random32() % 16);
+	if (top > hi || top < lo)
+		top = hi;
+
+	return lo + random32() % (top - lo + 1);
+}
+
+static void samplebegin()
+{
+	Start = hostnow();
+}
+
+static void sampleend(void *p, ptrdiff_t delta)
+{
+	size_t heap;
+
+	Res.lat[Res.n++] = hostnow() - Start;
+
+	if (p == NULL) {
+		Res.failed++;
+		return;
+	}
+
+	Res.live += delta;
+
+	if (Res.live > Res.peaklive)
+		Res.peaklive = Res.live;
+
+	heap = (char *) _sbrk(0) - Heapstart;
+
+	if (heap > Res.peakheap)
+		Res.peakheap = heap;
+}
+
+static void slotfree(const struct allocator *a, int i)
+{
+	samplebegin();
+
+	a->free(Slot[i]);
+
+	sampleend(Slot[i], -Slotsize[i]);
+
+	Slot[i] = NULL;
+	Slotsize[i] = 0;
+}
+
+static void slotmalloc(const struct allocator *a, int i, size_t sz)
+{
+	samplebegin();
+
+	Slot[i] = a->malloc(sz);
+
+	sampleend(Slot[i], sz);
+
+	Slotsize[i] = (Slot[i] != NULL) ? sz : 0;
+}
+
+static void freeall(const struct allocator *a)
+{
+	int i;
+
+	for (i = 0; i < SLOTS; ++i) {
+		if (Slot[i] != NULL)
+			slotfree(a, i);
+	}
+}
+
+// random malloc/free of path sized strings, like VFS does
+static void bench_strings(const struct allocator *a, size_t count)
+{
+	size_t i;
+	int s;
+
+	for (i = 0; i < count; ++i) {
+		s = random32() % SLOTS;
+
+		if (Slot[s] != NULL)
+			slotfree(a, s);
+		else
+			slotmalloc(a, s, randsize(8, 64));
+	}
+
+	freeall(a);
+}
+
+// random malloc/free of sizes up to a data block
+static void bench_mixed(const struct allocator *a, size_t count)
+{
+	size_t i;
+	int s;
+
+	for (i = 0; i < count; ++i) {
+		s = random32() % SLOTS;
+
+		if (Slot[s] != NULL)
+			slotfree(a, s);
+		else
+			slotmalloc(a, s, randsize(16, 4096));
+	}
+
+	freeall(a);
+}
+
+// buffers growing with realloc in small steps, like rfs inode data,
+// among small long living allocations
+static void bench_grow(const struct allocator *a, size_t count)
+{
+	size_t i;
+	void *p;
+	int s;
+
+	for (i = 0; i < count; ++i) {
+		s = random32() % GROWBUFS;
+
+		if (Slotsize[s] >= GROWMAX) {
+			slotfree(a, s);
+			continue;
+		}
+
+		samplebegin();
+
+		p = a->realloc(Slot[s], Slotsize[s] + GROWSTEP);
+
+		sampleend(p, GROWSTEP);
+
+		// failed realloc leaves old block
+		if (p != NULL) {
+			Slot[s] = p;
+			Slotsize[s] += GROWSTEP;
+		}
+
+		s = GROWBUFS + random32() % (SLOTS - GROWBUFS);
+
+		if (Slot[s] == NULL)
+			slotmalloc(a, s, randsize(8, 64));
+	}
+
+	freeall(a);
+}
+
+// small blocks between big ones are freed, then big blocks are
+// requested, that can only fit into merged holes
+static void bench_fragment(const struct allocator *a, size_t count)
+{
+	size_t i, rounds;
+	int s;
+
+	for (rounds = 0; rounds < count / SLOTS; ++rounds) {
+		for (s = 0; s < SLOTS; ++s)
+			slotmalloc(a, s, (s % 2) ? 32 : 256);
+
+		for (s = 1; s < SLOTS; s += 2)
+			slotfree(a, s);
+
+		for (s = 1; s < SLOTS; s += 4)
+			slotmalloc(a, s, 64);
+
+		for (i = 0; i < SLOTS; i += 2)
+			slotfree(a, i);
+
+		for (s = 0; s < SLOTS; s += 2)
+			slotmalloc(a, s, 512);
+
+		freeall(a);
+	}
+}
+
+static struct benchmark Benchmarks[] = {
+	{ "strings",	bench_strings },
+	{ "mixed",	bench_mixed },
+	{ "grow",	bench_grow },
+	{ "fragment",	bench_fragment },
+	{ NULL,		NULL }
+};
+
+static int uint64cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *((const uint64_t *) a);
+	y = *((const uint64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+static void report(const struct allocator *a, const char *name)
+{
+	uint64_t total;
+	size_t i;
+
+	total = 0;
+	for (i = 0; i < Res.n; ++i)
+		total += Res.lat[i];
+
+	qsort(Res.lat, Res.n, sizeof(uint64_t), uint64cmp);
+
+	printf("%-8s %-9s %8lu %8.1f %8lu %8lu %9lu %9lu %6.2f %6lu\n",
+		a->name, name, Res.n,
+		Res.n ? (double) total / Res.n : 0.0,
+		Res.n ? Res.lat[(Res.n - 1) * 99 / 100] : 0,
+		Res.n ? Res.lat[Res.n - 1] : 0,
+		Res.peaklive, Res.peakheap,
+		Res.peaklive ? (double) Res.peakheap / Res.peaklive : 0.0,
+		Res.failed);
+}
+
+// every run is done in own process, so it starts with empty heap
+// and allocator state
+static void runbench(const struct allocator *a, const struct benchmark *b,
+	size_t count)
+{
+	pid_t pid;
+
+	fflush(stdout);
+
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	Heapstart = _sbrk(0);
+
+	b->run(a, count);
+
+	report(a, b->name);
+
+	exit(0);
+}
+
+static void usage()
+{
+	const struct benchmark *b;
+
+	fprintf(stderr, "usage: heapbench [-a tlsf|firstfit] "
+		"[-b benchmark] [-n count]\n\nbenchmarks:");
+
+	for (b = Benchmarks; b->name != NULL; ++b)
+		fprintf(stderr, " %s", b->name);
+
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+int main(int argc, const char **argv)
+{
+	const struct allocator *a;
+	const struct benchmark *b;
+	const char *allocname, *benchname;
+	size_t count;
+	int i;
+
+	allocname = benchname = NULL;
+	count = DEFAULTCOUNT;
+
+	for (i = 1; i < argc; ++i) {
+		if (i + 1 >= argc || argv[i][0] != '-')
+			usage();
+
+		switch (argv[i++][1]) {
+		case 'a':	allocname = argv[i];		break;
+		case 'b':	benchname = argv[i];		break;
+		case 'n':	count = atol(argv[i]);		break;
+		default:	usage();
+		}
+	}
+
+	if (count == 0)
+		usage();
+
+	// fragment takes most samples, 3.5 per count
+	if ((Res.lat = calloc(count * 4, sizeof(uint64_t))) == NULL)
+		return 1;
+
+	printf("%-8s %-9s %8s %8s %8s %8s %9s %9s %6s %6s\n",
+		"alloc", "benchmark", "ops", "avg ns", "p99 ns", "max ns",
+		"peak live", "peak heap", "ratio", "failed");
+
+	for (b = Benchmarks; b->name != NULL; ++b) {
+		if (benchname != NULL && strcmp(benchname, b->name) != 0)
+			continue;
+
+		for (a = Allocators; a->name != NULL; ++a) {
+			if (allocname != NULL && strcmp(allocname, a->name) != 0)
+				continue;
+
+			runbench(a, b, count);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,997 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vfs.h"
+#include "filesystem.h"
+#include "sfs.h"
+#include "rfs.h"
+#include "simclock.h"
+#include "w25sim.h"
+#include "stripe.h"
+#include "trace.h"
+#include "stackprof.h"
+#include "calls.h"
+
+#define DEFAULTCOUNT 32
+#define DEFAULTSIZE 256
+#define DIRENTRIESMAX (DIRMAX / DIRRECORDSIZE - 1)
+#define SMALLFILESPERDIR 100
+#define LSDIRENTRIES 16
+#define MULTIAPPENDFILES 4
+
+struct benchenv {
+	const struct filesystem *fs;
+	struct bdevice *dev;
+
+	// second chip on the same simulated bus, NULL for rfs
+	struct bdevice *dev2;
+	size_t count;
+	size_t size;
+	char *buf;
+	FILE *trace;
+};
+
+struct benchresult {
+	uint64_t *simlat;
+	uint64_t *hostlat;
+	size_t n;
+	size_t written;
+	struct bdevstat stat;
+};
+
+struct benchmark {
+	const char *name;
+	int (*run)(struct benchenv *env);
+};
+
+static struct driver simdriver;
+static struct driver stripedriver;
+static struct bdevice simdev;
+static struct bdevice simdev2;
+static struct bdevice stripedev;
+static struct filesystem fs[2];
+
+static struct benchresult Res;
+static uint64_t Simstart, Hoststart;
+
+static uint64_t hostnow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// counters of both devices added together
+static void getstat(struct benchenv *env, struct bdevstat *st)
+{
+	struct bdevstat st2;
+
+	env->dev->ioctl(env->dev->priv, BDEV_GETSTAT, st);
+
+	if (env->dev2 == NULL)
+		return;
+
+	env->dev2->ioctl(env->dev2->priv, BDEV_GETSTAT, &st2);
+
+	st->programs += st2.programs;
+	st->programbytes += st2.programbytes;
+	st->erases += st2.erases;
+}
+
+static void resultreset(struct benchenv *env)
+{
+	Res.n = 0;
+	Res.written = 0;
+
+	if (env->dev != NULL)
+		getstat(env, &(Res.stat));
+}
+
+static void samplebegin()
+{
+	Simstart = simclock_now();
+	Hoststart = hostnow();
+}
+
+static void sampleend(size_t written)
+{
+	Res.hostlat[Res.n] = hostnow() - Hoststart;
+	Res.simlat[Res.n] = simclock_now() - Simstart;
+	Res.written += written;
+	Res.n++;
+}
+
+static int uint64cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *((const uint64_t *) a);
+	y = *((const uint64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *v, size_t n, int p)
+{
+	if (n == 0)
+		return 0;
+
+	return v[(n - 1) * p / 100];
+}
+
+static int randoffset(struct benchenv *env)
+{
+	return rand() % ((env->count - 1) * env->size + 1);
+}
+
+static int fillfile(const char *path, struct benchenv *env)
+{
+	int fd, r;
+	size_t i;
+
+	if ((fd = open(path, O_CREAT)) < 0)
+		return fd;
+
+	for (i = 0; i < env->count; ++i) {
+		if ((r = write(fd, env->buf, env->size)) < 0)
+			return r;
+	}
+
+	return fd;
+}
+
+static int fillinode(struct benchenv *env, size_t *n)
+{
+	size_t r, i;
+
+	*n = env->fs->inodecreate(env->dev, 0, FS_FILE);
+	if (fs_iserror(*n))
+		return fs_uint2interr(*n);
+
+	for (i = 0; i < env->count; ++i) {
+		r = env->fs->inodewrite(env->dev, *n, i * env->size,
+			env->buf, env->size);
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	return 0;
+}
+
+static int bench_inodecreate(struct benchenv *env)
+{
+	size_t i, n;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		n = env->fs->inodecreate(env->dev, env->size, FS_FILE);
+
+		sampleend(0);
+
+		if (fs_iserror(n))
+			return fs_uint2interr(n);
+	}
+
+	return 0;
+}
+
+static int bench_inodedelete(struct benchenv *env)
+{
+	size_t *inodes, i, r;
+
+	if ((inodes = malloc(env->count * sizeof(size_t))) == NULL)
+		return EOUTOFMEMORY;
+
+	for (i = 0; i < env->count; ++i) {
+		inodes[i] = env->fs->inodecreate(env->dev, env->size,
+			FS_FILE);
+		if (fs_iserror(inodes[i]))
+			return fs_uint2interr(inodes[i]);
+	}
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = env->fs->inodedelete(env->dev, inodes[i]);
+
+		sampleend(0);
+
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	free(inodes);
+
+	return 0;
+}
+
+static int bench_inodeset(struct benchenv *env)
+{
+	size_t i, n, r;
+
+	n = env->fs->inodecreate(env->dev, env->size, FS_FILE);
+	if (fs_iserror(n))
+		return fs_uint2interr(n);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = env->fs->inodeset(env->dev, n, env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	return 0;
+}
+
+static int bench_inodeget(struct benchenv *env)
+{
+	size_t i, n, r;
+
+	n = env->fs->inodecreate(env->dev, env->size, FS_FILE);
+	if (fs_iserror(n))
+		return fs_uint2interr(n);
+
+	if (fs_iserror(r = env->fs->inodeset(env->dev, n, env->buf,
+			env->size)))
+		return fs_uint2interr(r);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = env->fs->inodeget(env->dev, n, env->buf, env->size);
+
+		sampleend(0);
+
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	return 0;
+}
+
+static int bench_inodewrite(struct benchenv *env)
+{
+	size_t i, n, r;
+
+	n = env->fs->inodecreate(env->dev, 0, FS_FILE);
+	if (fs_iserror(n))
+		return fs_uint2interr(n);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = env->fs->inodewrite(env->dev, n, i * env->size,
+			env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	return 0;
+}
+
+static int bench_inoderead(struct benchenv *env)
+{
+	size_t i, n, r;
+	int rr;
+
+	if ((rr = fillinode(env, &n)) < 0)
+		return rr;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = env->fs->inoderead(env->dev, n, i * env->size,
+			env->buf, env->size);
+
+		sampleend(0);
+
+		if (fs_iserror(r))
+			return fs_uint2interr(r);
+	}
+
+	return 0;
+}
+
+static int bench_open(struct benchenv *env)
+{
+	size_t i;
+	int fd;
+
+	if ((fd = open("/f", O_CREAT)) < 0)
+		return fd;
+
+	close(fd);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		fd = open("/f", 0);
+
+		sampleend(0);
+
+		if (fd < 0)
+			return fd;
+
+		close(fd);
+	}
+
+	return 0;
+}
+
+static int bench_write(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = open("/f", O_CREAT)) < 0)
+		return fd;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = write(fd, env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	return close(fd);
+}
+
+// writes to files on two chips in turn, like to / and /dev on the
+// board; without second device both files are on the same one
+static int bench_dualwrite(struct benchenv *env)
+{
+	const char *path[2];
+	int fd[2], r;
+	size_t i;
+
+	path[0] = "/f";
+	path[1] = "/g";
+
+	if (env->dev2 != NULL) {
+		if ((r = mount(env->dev2, "/dev", env->fs)) < 0)
+			return r;
+
+		if ((r = format("/dev")) < 0)
+			return r;
+
+		path[1] = "/dev/f";
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if ((fd[i] = open(path[i], O_CREAT)) < 0)
+			return fd[i];
+	}
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = write(fd[i % 2], env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	close(fd[0]);
+	close(fd[1]);
+
+	return (env->dev2 != NULL) ? umount("/dev") : 0;
+}
+
+static int bench_randwrite(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = fillfile("/f", env)) < 0)
+		return fd;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		lseek(fd, randoffset(env));
+		r = write(fd, env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	return close(fd);
+}
+
+static int bench_append(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = open("/f", O_CREAT)) < 0)
+		return fd;
+
+	close(fd);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		if ((fd = open("/f", 0)) < 0)
+			return fd;
+
+		lseek(fd, i * env->size);
+		r = write(fd, env->buf, env->size);
+		close(fd);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+// appends to several files in turn, so their data buffers are
+// neighbours on the heap, when filesystem keeps them there
+static int bench_multiappend(struct benchenv *env)
+{
+	char path[PATHMAX];
+	size_t i;
+	int fd[MULTIAPPENDFILES];
+	int f, r;
+
+	for (f = 0; f < MULTIAPPENDFILES; ++f) {
+		sprintf(path, "/f%d", f);
+
+		if ((fd[f] = open(path, O_CREAT)) < 0)
+			return fd[f];
+	}
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = write(fd[i % MULTIAPPENDFILES], env->buf, env->size);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	for (f = 0; f < MULTIAPPENDFILES; ++f)
+		close(fd[f]);
+
+	return 0;
+}
+
+static int bench_read(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = fillfile("/f", env)) < 0)
+		return fd;
+
+	lseek(fd, 0);
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = read(fd, env->buf, env->size);
+
+		sampleend(0);
+
+		if (r < 0)
+			return r;
+	}
+
+	return close(fd);
+}
+
+static int bench_randread(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = fillfile("/f", env)) < 0)
+		return fd;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		lseek(fd, randoffset(env));
+		r = read(fd, env->buf, env->size);
+
+		sampleend(0);
+
+		if (r < 0)
+			return r;
+	}
+
+	return close(fd);
+}
+
+// random reads, each right after erase of the last sector of device
+// is started, like when filesystem cleans up in background
+static int bench_eraseread(struct benchenv *env)
+{
+	size_t i;
+	int fd, r;
+
+	if ((fd = fillfile("/f", env)) < 0)
+		return fd;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		if (env->dev != NULL) {
+			env->dev->erasesector(env->dev->priv,
+				env->dev->totalsize - env->dev->sectorsize);
+		}
+
+		samplebegin();
+
+		lseek(fd, randoffset(env));
+		r = read(fd, env->buf, env->size);
+
+		sampleend(0);
+
+		if (r < 0)
+			return r;
+	}
+
+	return close(fd);
+}
+
+static int bench_smallfiles(struct benchenv *env)
+{
+	char path[PATHMAX];
+	size_t i;
+	int fd, r;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		if (i % SMALLFILESPERDIR == 0) {
+			sprintf(path, "/d%lu", i / SMALLFILESPERDIR);
+
+			if ((r = mkdir(path)) < 0)
+				return r;
+		}
+
+		sprintf(path, "/d%lu/f%lu", i / SMALLFILESPERDIR, i);
+
+		samplebegin();
+
+		if ((fd = open(path, O_CREAT)) < 0)
+			return fd;
+
+		r = write(fd, env->buf, env->size);
+		close(fd);
+
+		sampleend(env->size);
+
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int bench_mkdir(struct benchenv *env)
+{
+	char path[PATHMAX];
+	size_t i;
+	int r;
+
+	if (env->count > DIRENTRIESMAX)
+		return EWRONGSIZE;
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		sprintf(path, "/m%lu", i);
+
+		samplebegin();
+
+		r = mkdir(path);
+
+		sampleend(0);
+
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int bench_lsdir(struct benchenv *env)
+{
+	const char *list[DIRENTRIESMAX + 1];
+	char path[PATHMAX], buf[DIRMAX];
+	size_t i;
+	int r;
+
+	for (i = 0; i < LSDIRENTRIES; ++i) {
+		sprintf(path, "/m%lu", i);
+
+		if ((r = mkdir(path)) < 0)
+			return r;
+	}
+
+	resultreset(env);
+
+	for (i = 0; i < env->count; ++i) {
+		samplebegin();
+
+		r = lsdir("/", list, buf, DIRMAX);
+
+		sampleend(0);
+
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static struct benchmark Benchmarks[] = {
+	{"inodecreate",	bench_inodecreate},
+	{"inodedelete",	bench_inodedelete},
+	{"inodeset",	bench_inodeset},
+	{"inodeget",	bench_inodeget},
+	{"inodewrite",	bench_inodewrite},
+	{"inoderead",	bench_inoderead},
+	{"open",	bench_open},
+	{"write",	bench_write},
+	{"dualwrite",	bench_dualwrite},
+	{"randwrite",	bench_randwrite},
+	{"append",	bench_append},
+	{"multiappend",	bench_multiappend},
+	{"read",	bench_read},
+	{"randread",	bench_randread},
+	{"eraseread",	bench_eraseread},
+	{"smallfiles",	bench_smallfiles},
+	{"mkdir",	bench_mkdir},
+	{"lsdir",	bench_lsdir},
+	{NULL,		NULL}
+};
+
+static int setup(struct benchenv *env)
+{
+	int r;
+
+	if ((r = mount(env->dev, "/", env->fs)) < 0)
+		return r;
+
+	if ((r = format("/")) < 0)
+		return r;
+
+	return 0;
+}
+
+static void report(struct benchenv *env, const char *name)
+{
+	uint64_t *lat, total, hosttotal;
+	struct bdevstat st;
+	size_t i;
+
+	// filesystems without device only cost CPU time, so for them
+	// latency is measured in host time
+	lat = (env->dev != NULL) ? Res.simlat : Res.hostlat;
+
+	total = hosttotal = 0;
+	for (i = 0; i < Res.n; ++i) {
+		total += lat[i];
+		hosttotal += Res.hostlat[i];
+	}
+
+	qsort(lat, Res.n, sizeof(uint64_t), uint64cmp);
+
+	printf("%-4s %-12s %6lu %5lu %10.1f %9.3f %9.3f %8.2f",
+		env->fs->name, name, env->size, Res.n,
+		total ? Res.n * 1e9 / total : 0.0,
+		percentile(lat, Res.n, 50) / 1e6,
+		percentile(lat, Res.n, 99) / 1e6,
+		Res.n ? hosttotal / 1e3 / Res.n : 0.0);
+
+	if (env->dev == NULL || Res.n == 0) {
+		printf(" %8s %8s %8s %8s\n", "-", "-", "-", "-");
+		return;
+	}
+
+	getstat(env, &st);
+
+	printf(" %8.2f %8.2f",
+		(double) (st.programs
+			- Res.stat.programs) / Res.n,
+		(double) (st.erases
+			- Res.stat.erases) / Res.n);
+
+	if (Res.written == 0) {
+		printf(" %8s %8s\n", "-", "-");
+		return;
+	}
+
+	printf(" %8.2f %8.3f\n",
+		(double) (st.programbytes
+			- Res.stat.programbytes) / Res.written,
+		(double) (st.erases
+			- Res.stat.erases) * 1024 / Res.written);
+}
+
+static void dumptrace(FILE *f)
+{
+	struct trace_record r;
+	size_t i;
+
+	for (i = 0; i < trace_count(); ++i) {
+		trace_get(i, &r);
+
+		fprintf(f, "%08x %08x %08x %08x\n",
+			r.time, r.event, r.addr, r.size);
+	}
+}
+
+static void stackreport()
+{
+	struct stackprof_stat st;
+	int i;
+
+	printf("\n%-8s %8s %8s\n", "call", "calls", "bytes");
+
+	for (i = 0; i < STACKPROF_CALLS; ++i) {
+		stackprof_get(i, &st);
+
+		if (st.calls == 0)
+			continue;
+
+		printf("%-8s %8u %7u%s\n", stackprof_strcall(i),
+			st.calls, st.maxdepth, st.overflow ? "+" : "");
+	}
+}
+
+static void heapreport()
+{
+	struct heapstat st;
+
+	heap_getstat(&st);
+
+	printf("\nheap: %u malloc, %u free, %u realloc (%u in place), "
+		"peak %lu bytes\n", st.mallocs, st.frees, st.reallocs,
+		st.inplace, st.peakbytes);
+}
+
+static int runbench(struct benchenv *env, const struct benchmark *b)
+{
+	int r;
+
+	if ((r = setup(env)) < 0)
+		return r;
+
+	trace_clear();
+	trace_enable(env->trace != NULL);
+
+	r = b->run(env);
+
+	trace_enable(0);
+
+	if (env->trace != NULL)
+		dumptrace(env->trace);
+
+	if (r < 0) {
+		printf("%-4s %-12s error: %s\n", env->fs->name, b->name,
+			vfs_strerror(r));
+	}
+	else
+		report(env, b->name);
+
+	umount("/");
+
+	return 0;
+}
+
+static void usage()
+{
+	const struct benchmark *b;
+
+	fprintf(stderr, "usage: sfsbench [-f sfs|rfs] [-b benchmark] "
+		"[-n count] [-s size] [-c spiclock] [-r read|fast|dual|quad]\n"
+		"\t[-z chipsize MB] [-t tracefile] [-S] [-H] [-N] [-R]\n\n"
+		"benchmarks:");
+
+	for (b = Benchmarks; b->name != NULL; ++b)
+		fprintf(stderr, " %s", b->name);
+
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+int main(int argc, const char **argv)
+{
+	struct w25sim_device sd;
+	struct stripe_device st;
+	struct benchenv env;
+	const struct benchmark *b;
+	const char *fsname, *benchname;
+	int stack, heap, stripe, i;
+
+	fsname = benchname = NULL;
+	stack = heap = stripe = 0;
+	env.count = DEFAULTCOUNT;
+	env.size = DEFAULTSIZE;
+	env.trace = NULL;
+
+	w25sim_defaultdevice(&sd, NULL);
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-S") == 0) {
+			stack = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-H") == 0) {
+			heap = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-N") == 0) {
+			sd.suspend = 0;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-R") == 0) {
+			stripe = 1;
+			continue;
+		}
+
+		if (i + 1 >= argc || argv[i][0] != '-')
+			usage();
+
+		switch (argv[i++][1]) {
+		case 'f':	fsname = argv[i];		break;
+		case 'b':	benchname = argv[i];		break;
+		case 'n':	env.count = atol(argv[i]);	break;
+		case 's':	env.size = atol(argv[i]);	break;
+		case 'c':	sd.spiclock = atol(argv[i]);	break;
+		case 'z':
+			sd.totalsize = (size_t) atol(argv[i]) * 1024 * 1024;
+			break;
+		case 'r':
+			if ((sd.readmode = w25sim_readmode(argv[i])) < 0)
+				usage();
+
+			break;
+		case 't':
+			if ((env.trace = fopen(argv[i], "w")) == NULL) {
+				perror(argv[i]);
+				return 1;
+			}
+
+			break;
+		default:	usage();
+		}
+	}
+
+	if (env.count == 0 || env.size == 0 || sd.spiclock == 0
+			|| sd.totalsize < 2 * W25SIM_BLOCKSIZE)
+		usage();
+
+	env.buf = malloc(env.size);
+	Res.simlat = malloc(env.count * sizeof(uint64_t));
+	Res.hostlat = malloc(env.count * sizeof(uint64_t));
+
+	if (env.buf == NULL || Res.simlat == NULL || Res.hostlat == NULL)
+		return 1;
+
+	for (i = 0; i < env.size; ++i)
+		env.buf[i] = 'a' + i % ('z' - 'a');
+
+	w25sim_getdriver(&simdriver);
+
+	if (simdriver.initdevice(&sd, &simdev) < 0
+			|| simdriver.initdevice(&sd, &simdev2) < 0)
+		return 1;
+
+	stripe_getdriver(&stripedriver);
+
+	st.members[0] = &simdev;
+	st.members[1] = &simdev2;
+	st.count = 2;
+
+	if (stripedriver.initdevice(&st, &stripedev) < 0)
+		return 1;
+
+	sfs_getfs(fs + 0);
+	rfs_getfs(fs + 1);
+
+	vfsinit();
+	trace_init();
+	stackprof_enable(stack);
+
+	printf("%-4s %-12s %6s %5s %10s %9s %9s %8s %8s %8s %8s %8s\n",
+		"fs", "benchmark", "size", "ops", "ops/s", "p50 ms",
+		"p99 ms", "host us", "pages/op", "erase/op",
+		"prog/B", "erase/kB");
+
+	for (i = 0; i < 2; ++i) {
+		if (fsname != NULL && strcmp(fsname, fs[i].name) != 0)
+			continue;
+
+		env.fs = fs + i;
+		env.dev = (i == 0) ? &simdev : NULL;
+		env.dev2 = (i == 0) ? &simdev2 : NULL;
+
+		// both chips are taken by stripe
+		if (i == 0 && stripe) {
+			env.dev = &stripedev;
+			env.dev2 = NULL;
+		}
+
+		for (b = Benchmarks; b->name != NULL; ++b) {
+			if (benchname != NULL
+					&& strcmp(benchname, b->name) != 0)
+				continue;
+
+			srand(1);
+
+			runbench(&env, b);
+		}
+	}
+
+	if (env.trace != NULL)
+		fclose(env.trace);
+
+	if (stack)
+		stackreport();
+
+	if (heap)
+		heapreport();
+
+	return 0;
+}
@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "vfs.h"
+#include "filesystem.h"
+#include "sfs.h"
+#include "simclock.h"
+#include "w25sim.h"
+#include "mirror.h"
+
+#define DEFAULTTRIALS 32
+#define DEFAULTSIZE 4096
+#define FILEPATH "/f"
+
+enum FAULT_RESULT {
+	FAULT_OLD	= 0,
+	FAULT_NEW	= 1,
+	FAULT_CORRUPT	= 2,
+	FAULT_LOST	= 3,
+	FAULT_RESULTS	= 4
+};
+
+struct faultenv {
+	struct w25sim_device *sd;
+
+	// second copy with -M, NULL otherwise
+	struct w25sim_device *sd2;
+
+	size_t trials;
+	size_t size;
+	char *olddata;
+	char *newdata;
+	char *buf;
+	uint8_t *snapshot;
+	int verbose;
+};
+
+static struct driver simdriver, mirrordriver;
+static struct bdevice simdev, simdev2, mirrordev;
+
+// device sfs is mounted on: simdev or mirror of simdev and simdev2
+static struct bdevice *Dev = &simdev;
+static struct filesystem sfs;
+
+static jmp_buf Powercut;
+static int Fd = -1;
+
+static uint64_t *Recovery;
+static size_t Results[FAULT_RESULTS];
+static uint32_t Retries;
+
+static const char *ResultName[] = {
+	"old", "new", "corrupt", "lost"
+};
+
+static void powercut(void *arg)
+{
+	longjmp(Powercut, 1);
+}
+
+static int writefile(const char *data, size_t size, int flags)
+{
+	int r;
+
+	if ((Fd = open(FILEPATH, flags)) < 0)
+		return Fd;
+
+	r = write(Fd, data, size);
+
+	close(Fd);
+	Fd = -1;
+
+	return r;
+}
+
+// RAM state is lost with power, so every descriptor and mount left
+// by the interrupted call is released, and the next trial starts
+// with the VFS and heap state, that vfsinit() left
+static int reboot(struct faultenv *env)
+{
+	int fd;
+
+	for (fd = 0; fd < FDMAX; ++fd)
+		close(fd);
+
+	Fd = -1;
+
+	umount("/");
+
+	env->sd->cutat = 0;
+	w25sim_poweron(env->sd);
+
+	return 0;
+}
+
+static enum FAULT_RESULT firstaccess(struct faultenv *env)
+{
+	int fd, r;
+
+	if (mount(Dev, "/", &sfs) < 0)
+		return FAULT_LOST;
+
+	if ((fd = open(FILEPATH, 0)) < 0)
+		return FAULT_LOST;
+
+	memset(env->buf, 0, env->size);
+
+	r = read(fd, env->buf, env->size);
+
+	close(fd);
+
+	if (r < 0)
+		return FAULT_LOST;
+
+	if (memcmp(env->buf, env->olddata, env->size) == 0)
+		return FAULT_OLD;
+
+	if (memcmp(env->buf, env->newdata, env->size) == 0)
+		return FAULT_NEW;
+
+	return FAULT_CORRUPT;
+}
+
+static void trial(struct faultenv *env, size_t n, uint32_t cutat)
+{
+	struct bdevstat before, after;
+	enum FAULT_RESULT r;
+	uint64_t start;
+
+	Dev->ioctl(Dev->priv, BDEV_GETSTAT, &before);
+
+	start = simclock_now();
+
+	r = firstaccess(env);
+
+	Recovery[n] = simclock_now() - start;
+	Results[r]++;
+
+	Dev->ioctl(Dev->priv, BDEV_GETSTAT, &after);
+
+	if (env->verbose) {
+		printf("%5lu %8u %-8s %10.3f %8u\n", n, cutat,
+			ResultName[r], Recovery[n] / 1e6,
+			after.retries - before.retries);
+	}
+
+	Retries += after.retries - before.retries;
+
+	umount("/");
+}
+
+static int setup(struct faultenv *env)
+{
+	int r;
+
+	if ((r = mount(Dev, "/", &sfs)) < 0)
+		return r;
+
+	if ((r = format("/")) < 0)
+		return r;
+
+	if ((r = writefile(env->olddata, env->size, O_CREAT)) < 0)
+		return r;
+
+	umount("/");
+
+	memmove(env->snapshot, env->sd->mem, env->sd->totalsize);
+
+	return 0;
+}
+
+static void restore(struct faultenv *env)
+{
+	memmove(env->sd->mem, env->snapshot, env->sd->totalsize);
+}
+
+// cut power at evenly spread program/erase operations of file
+// rewrite and measure first access after reboot
+static int cuttest(struct faultenv *env)
+{
+	uint32_t total, cutat;
+	size_t n;
+	int r;
+
+	w25sim_poweron(env->sd);
+
+	if ((r = mount(Dev, "/", &sfs)) < 0)
+		return r;
+
+	if ((r = writefile(env->newdata, env->size, 0)) < 0)
+		return r;
+
+	umount("/");
+
+	total = env->sd->opcount;
+
+	if (env->trials > total)
+		env->trials = total;
+
+	for (n = 0; n < env->trials; ++n) {
+		restore(env);
+
+		cutat = 1 + n * total / env->trials;
+
+		w25sim_poweron(env->sd);
+		env->sd->cutat = cutat;
+
+		if (setjmp(Powercut) == 0) {
+			mount(Dev, "/", &sfs);
+			writefile(env->newdata, env->size, 0);
+		}
+
+		reboot(env);
+
+		trial(env, n, cutat);
+	}
+
+	return 0;
+}
+
+// data areas of the test file blocks, looked up through its inode
+static size_t filedata(struct faultenv *env, size_t *start, size_t *len,
+	size_t max)
+{
+	char dir[DIRMAX];
+	struct sfs_inode in;
+	struct sfs_blockmeta meta;
+	size_t off, n, block, cnt;
+
+	if (fs_iserror(sfs.inodeget(Dev, sfs.rootinode, dir, DIRMAX)))
+		return 0;
+
+	n = 0xffffffff;
+	for (off = 0; off + DIRRECORDSIZE <= DIRMAX;
+			off += DIRRECORDSIZE) {
+		memmove(&n, dir + off, sizeof(uint32_t));
+
+		if (n == 0xffffffff || strcmp(dir + off
+				+ sizeof(uint32_t), FILEPATH + 1) == 0)
+			break;
+	}
+
+	if (n == 0xffffffff || off + DIRRECORDSIZE > DIRMAX)
+		return 0;
+
+	sfs.dumpinode(Dev, n, &in);
+
+	cnt = 0;
+	for (block = in.blocks.block[0]; block != 0 && cnt < max;
+			block = meta.next) {
+		sfs.dumpblockmeta(Dev, block, &meta);
+
+		start[cnt] = block + sizeof(struct sfs_blockmeta);
+		len[cnt++] = meta.datasize;
+	}
+
+	return cnt;
+}
+
+// flip bits in the test file data on the first chip, like data lost
+// during storage, that program verification can't catch. Returns
+// number of flips, that hit file data.
+static uint32_t damage(struct faultenv *env, uint32_t bits)
+{
+	size_t *start, *len;
+	size_t cnt, total, max, addr, i;
+	uint32_t hit;
+
+	max = env->sd->totalsize / Dev->sectorsize;
+
+	start = malloc(max * sizeof(size_t));
+	len = malloc(max * sizeof(size_t));
+
+	hit = cnt = total = 0;
+
+	if (start != NULL && len != NULL)
+		cnt = filedata(env, start, len, max);
+
+	for (i = 0; i < cnt; ++i)
+		total += len[i];
+
+	for (; total > 0 && hit < bits; ++hit) {
+		addr = rand() % total;
+
+		for (i = 0; addr >= len[i]; ++i)
+			addr -= len[i];
+
+		env->sd->mem[start[i] + addr] ^= 1 << (rand() % 8);
+	}
+
+	free(start);
+	free(len);
+
+	return hit;
+}
+
+// read file with random bit flips on the bus
+static int fliptest(struct faultenv *env, uint32_t readflips,
+	uint32_t damagebits)
+{
+	uint32_t hit;
+	size_t n;
+
+	if (damagebits > 0) {
+		hit = damage(env, damagebits);
+
+		printf("damage: %u of %u flips in file data\n",
+			hit, damagebits);
+	}
+
+	env->sd->readflips = readflips;
+
+	if (env->sd2 != NULL)
+		env->sd2->readflips = readflips;
+
+	for (n = 0; n < env->trials; ++n)
+		trial(env, n, 0);
+
+	env->sd->readflips = 0;
+
+	if (env->sd2 != NULL)
+		env->sd2->readflips = 0;
+
+	return 0;
+}
+
+static int uint64cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *((const uint64_t *) a);
+	y = *((const uint64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+static void report(struct faultenv *env, const char *mode)
+{
+	size_t n;
+
+	n = env->trials;
+
+	qsort(Recovery, n, sizeof(uint64_t), uint64cmp);
+
+	printf("%-4s %6lu %6lu %6lu %7lu %6lu %9.3f %9.3f %9.3f %9.2f\n",
+		mode, n, Results[FAULT_OLD], Results[FAULT_NEW],
+		Results[FAULT_CORRUPT], Results[FAULT_LOST],
+		n ? Recovery[(n - 1) * 50 / 100] / 1e6 : 0.0,
+		n ? Recovery[(n - 1) * 99 / 100] / 1e6 : 0.0,
+		n ? Recovery[n - 1] / 1e6 : 0.0,
+		n ? (double) Retries / n : 0.0);
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: sfsfault [-m cut|flip] [-n trials] "
+		"[-s size] [-r readflips] [-p programflips] [-d bits] "
+		"[-M] [-v]\n");
+
+	exit(1);
+}
+
+int main(int argc, const char **argv)
+{
+	struct w25sim_device sd;
+	struct mirror_device md;
+	struct faultenv env;
+	const char *mode;
+	uint32_t readflips, programflips, damagebits;
+	size_t i;
+	int r, mirror;
+
+	mode = "cut";
+	readflips = 10;
+	programflips = 0;
+	damagebits = 0;
+
+	env.trials = DEFAULTTRIALS;
+	env.size = DEFAULTSIZE;
+	env.verbose = 0;
+	env.sd2 = NULL;
+	mirror = 0;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-v") == 0) {
+			env.verbose = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-M") == 0) {
+			mirror = 1;
+			continue;
+		}
+
+		if (i + 1 >= argc || argv[i][0] != '-')
+			usage();
+
+		switch (argv[i++][1]) {
+		case 'm':	mode = argv[i];				break;
+		case 'n':	env.trials = atol(argv[i]);		break;
+		case 's':	env.size = atol(argv[i]);		break;
+		case 'r':	readflips = atol(argv[i]);		break;
+		case 'p':	programflips = atol(argv[i]);		break;
+		case 'd':	damagebits = atol(argv[i]);		break;
+		default:	usage();
+		}
+	}
+
+	if (env.trials == 0 || env.size == 0)
+		usage();
+
+	if (strcmp(mode, "cut") != 0 && strcmp(mode, "flip") != 0)
+		usage();
+
+	// power cut test restores snapshot of one chip only
+	if (mirror && strcmp(mode, "flip") != 0)
+		usage();
+
+	env.olddata = malloc(env.size);
+	env.newdata = malloc(env.size);
+	env.buf = malloc(env.size);
+	Recovery = malloc(env.trials * sizeof(uint64_t));
+
+	if (env.olddata == NULL || env.newdata == NULL
+			|| env.buf == NULL || Recovery == NULL)
+		return 1;
+
+	for (i = 0; i < env.size; ++i) {
+		env.olddata[i] = 'a' + i % ('z' - 'a');
+		env.newdata[i] = 'A' + i % ('Z' - 'A');
+	}
+
+	w25sim_getdriver(&simdriver);
+	w25sim_defaultdevice(&sd, NULL);
+
+	sd.powercut = powercut;
+
+	if (simdriver.initdevice(&sd, &simdev) < 0)
+		return 1;
+
+	env.sd = (struct w25sim_device *) simdev.priv;
+
+	// the second chip gets own flips, so both copies are not
+	// damaged at the same places
+	if (mirror) {
+		w25sim_defaultdevice(&sd, NULL);
+		sd.seed = 0x9e3779b9;
+
+		if (simdriver.initdevice(&sd, &simdev2) < 0)
+			return 1;
+
+		env.sd2 = (struct w25sim_device *) simdev2.priv;
+
+		mirror_getdriver(&mirrordriver);
+
+		md.members[0] = &simdev;
+		md.members[1] = &simdev2;
+
+		if (mirrordriver.initdevice(&md, &mirrordev) < 0)
+			return 1;
+
+		Dev = &mirrordev;
+	}
+
+	if ((env.snapshot = malloc(env.sd->totalsize)) == NULL)
+		return 1;
+
+	sfs_getfs(&sfs);
+
+	vfsinit();
+
+	// persistent flips damage the file already when it's written
+	env.sd->programflips = programflips;
+
+	if (env.sd2 != NULL)
+		env.sd2->programflips = programflips;
+
+	if ((r = setup(&env)) < 0) {
+		fprintf(stderr, "sfsfault: %s\n", vfs_strerror(r));
+		return 1;
+	}
+
+	env.sd->programflips = 0;
+
+	if (env.sd2 != NULL)
+		env.sd2->programflips = 0;
+
+	if (env.verbose) {
+		printf("%5s %8s %-8s %10s %8s\n", "trial", "cut op",
+			"result", "ms", "retries");
+	}
+
+	if (strcmp(mode, "cut") == 0)
+		r = cuttest(&env);
+	else
+		r = fliptest(&env, readflips, damagebits);
+
+	if (r < 0) {
+		fprintf(stderr, "sfsfault: %s\n", vfs_strerror(r));
+		return 1;
+	}
+
+	printf("%-4s %6s %6s %6s %7s %6s %9s %9s %9s %9s\n",
+		"mode", "trials", "old", "new", "corrupt", "lost",
+		"p50 ms", "p99 ms", "max ms", "retries");
+
+	report(&env, mode);
+
+	return 0;
+}
@@ -0,0 +1,42 @@
+#include "stm32f4xx_hal.h"
+
+#include "simclock.h"
+
+static uint64_t Now = 0;
+static struct simdwt Simdwt;
+
+uint32_t SystemCoreClock = 16000000;
+struct simcoredebug Simcoredebug;
+
+uint64_t simclock_now()
+{
+	return Now;
+}
+
+void simclock_advance(uint64_t ns)
+{
+	Now += ns;
+}
+
+void simclock_waituntil(uint64_t t)
+{
+	if (t > Now)
+		Now = t;
+}
+
+struct simdwt *simclock_dwt()
+{
+	Simdwt.CYCCNT = Now * (SystemCoreClock / 1000000) / 1000;
+
+	return &Simdwt;
+}
+
+void HAL_Delay(uint32_t delay)
+{
+	simclock_advance((uint64_t) delay * 1000000);
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return Now / 1000000;
+}
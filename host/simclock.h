@@ -0,0 +1,13 @@
+#ifndef SIMCLOCK_H
+#define SIMCLOCK_H
+
+#include <stdint.h>
+
+// simulated time in nanoseconds since start of the program
+uint64_t simclock_now();
+
+void simclock_advance(uint64_t ns);
+
+void simclock_waituntil(uint64_t t);
+
+#endif
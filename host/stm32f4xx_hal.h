@@ -0,0 +1,38 @@
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "simclock.h"
+
+// Host replacement for the parts of HAL that filesystem code
+// depends on. Delays don't sleep, they advance simulated time.
+
+struct simdwt {
+	uint32_t CTRL;
+	uint32_t CYCCNT;
+};
+
+struct simcoredebug {
+	uint32_t DEMCR;
+};
+
+#define DWT_CTRL_CYCCNTENA_Msk 0x1
+#define CoreDebug_DEMCR_TRCENA_Msk 0x1000000
+
+// every access to DWT gets cycle counter computed from
+// simulated time and SystemCoreClock
+#define DWT (simclock_dwt())
+#define CoreDebug (&Simcoredebug)
+
+extern uint32_t SystemCoreClock;
+extern struct simcoredebug Simcoredebug;
+
+struct simdwt *simclock_dwt();
+
+void HAL_Delay(uint32_t delay);
+
+uint32_t HAL_GetTick(void);
+
+#endif
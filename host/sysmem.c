@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#ifndef HOST_HEAPSIZE
+#define HOST_HEAPSIZE (1024 * 1024)
+#endif
+
+static uint8_t Heap[HOST_HEAPSIZE];
+static uint8_t *Heapend = Heap;
+
+// same contract as _sbrk() of the board, but on top of static array,
+// so code that looks at the break can run on host
+void *_sbrk(ptrdiff_t incr)
+{
+	uint8_t *prev;
+
+	if (Heapend + incr > Heap + HOST_HEAPSIZE || Heapend + incr < Heap) {
+		errno = ENOMEM;
+		return (void *) -1;
+	}
+
+	prev = Heapend;
+	Heapend += incr;
+
+	return prev;
+}
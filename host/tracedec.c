@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define DEFAULTCLOCK 16000000
+#define STACKMAX 32
+
+struct frame {
+	struct trace_record enter;
+	uint32_t duration;
+	uint32_t childtime;
+	int depth;
+	int closed;
+	int parent;
+};
+
+static struct frame *Frames;
+static size_t Framecount;
+static size_t Framemax;
+
+static double clocktous(uint32_t t, double clock)
+{
+	return t * 1000000.0 / clock;
+}
+
+static int readframes(FILE *f)
+{
+	struct trace_record r;
+	int stack[STACKMAX];
+	int sp, i;
+
+	sp = 0;
+
+	while (fscanf(f, "%x %x %x %x", &r.time, &r.event,
+			&r.addr, &r.size) == 4) {
+		uint8_t ev;
+
+		ev = trace_recordevent(&r);
+
+		if (ev & TRACE_EXIT) {
+			// exit without enter means that enter record was
+			// overwritten in ring, skip it
+			for (i = sp - 1; i >= 0; --i) {
+				if (trace_recordevent(&Frames[stack[i]].enter)
+						== (ev & ~TRACE_EXIT))
+					break;
+			}
+
+			if (i < 0)
+				continue;
+
+			sp = i;
+
+			// unsigned subtraction handles counter wrap
+			Frames[stack[sp]].duration
+				= r.time - Frames[stack[sp]].enter.time;
+			Frames[stack[sp]].closed = 1;
+
+			if (Frames[stack[sp]].parent >= 0) {
+				Frames[Frames[stack[sp]].parent].childtime
+					+= Frames[stack[sp]].duration;
+			}
+
+			continue;
+		}
+
+		if (Framecount == Framemax) {
+			Framemax = (Framemax == 0) ? 1024 : Framemax * 2;
+
+			Frames = realloc(Frames, Framemax * sizeof(struct frame));
+			if (Frames == NULL)
+				return (-1);
+		}
+
+		if (sp == STACKMAX)
+			sp--;
+
+		memset(Frames + Framecount, 0, sizeof(struct frame));
+
+		Frames[Framecount].enter = r;
+		Frames[Framecount].depth = sp;
+		Frames[Framecount].parent = (sp > 0) ? stack[sp - 1] : -1;
+
+		stack[sp++] = Framecount++;
+	}
+
+	return 0;
+}
+
+static void printtimeline(double clock)
+{
+	uint32_t start;
+	size_t i;
+
+	if (Framecount == 0)
+		return;
+
+	start = Frames[0].enter.time;
+
+	printf("%12s %10s  %s\n", "start us", "dur us", "event");
+
+	for (i = 0; i < Framecount; ++i) {
+		struct trace_record *r;
+
+		r = &(Frames[i].enter);
+
+		printf("%12.1f ", clocktous(r->time - start, clock));
+
+		if (Frames[i].closed)
+			printf("%10.1f  ", clocktous(Frames[i].duration, clock));
+		else
+			printf("%10s  ", "?");
+
+		printf("%*s%s n=%u addr=0x%x size=%u\n",
+			Frames[i].depth * 2, "",
+			trace_strevent(trace_recordevent(r)),
+			trace_recordn(r), r->addr, r->size);
+	}
+}
+
+static void printstack(int i)
+{
+	if (Frames[i].parent >= 0) {
+		printstack(Frames[i].parent);
+		printf(";");
+	}
+
+	printf("%s", trace_strevent(trace_recordevent(&(Frames[i].enter))));
+}
+
+// folded stacks with self time in microseconds, input for flamegraph.pl
+static void printfolded(double clock)
+{
+	size_t i;
+
+	for (i = 0; i < Framecount; ++i) {
+		if (!Frames[i].closed)
+			continue;
+
+		printstack(i);
+		printf(" %.0f\n", clocktous(Frames[i].duration
+			- Frames[i].childtime, clock));
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: tracedec [-c clock] [-f] [tracefile]\n");
+
+	exit(1);
+}
+
+int main(int argc, const char **argv)
+{
+	const char *path;
+	double clock;
+	FILE *f;
+	int folded, i;
+
+	clock = DEFAULTCLOCK;
+	folded = 0;
+	path = NULL;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-f") == 0)
+			folded = 1;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			clock = atof(argv[++i]);
+		else if (argv[i][0] != '-' && path == NULL)
+			path = argv[i];
+		else
+			usage();
+	}
+
+	if (clock <= 0)
+		usage();
+
+	f = stdin;
+
+	if (path != NULL && (f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	if (readframes(f) < 0) {
+		fprintf(stderr, "tracedec: out of memory\n");
+		return 1;
+	}
+
+	if (folded)
+		printfolded(clock);
+	else
+		printtimeline(clock);
+
+	return 0;
+}
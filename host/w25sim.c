@@ -0,0 +1,960 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "simclock.h"
+#include "trace.h"
+#include "w25sim.h"
+#include "sfdp.h"
+
+static struct w25sim_device devs[W25SIM_MAXDEVS];
+static size_t devcount = 0;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Every function below charges simulated time for the same bus
+// traffic, that w25.c generates for corresponding operation, so
+// numbers got from simulator can be compared with real device.
+static void w25sim_transfer(struct w25sim_device *dev, size_t sz)
+{
+	simclock_advance((uint64_t) dev->tcmd * 1000
+		+ (uint64_t) sz * 8 * 1000000000 / dev->spiclock);
+}
+
+// read command and address are sent on one line, dummy clocks of
+// fast reads take one byte time, data comes on 1, 2 or 4 lines; 0x03
+// Read can't go faster than W25SIM_READCLOCK
+static void w25sim_readtransfer(struct w25sim_device *dev, size_t sz)
+{
+	uint64_t clock, bits;
+
+	clock = dev->spiclock;
+	bits = (4 + dev->addr4) * 8;
+
+	switch (dev->readmode) {
+	case W25SIM_READ:
+		clock = min(clock, W25SIM_READCLOCK);
+		bits += sz * 8;
+		break;
+
+	case W25SIM_FASTREAD:
+		bits += 8 + sz * 8;
+		break;
+
+	case W25SIM_DUALREAD:
+		bits += 8 + sz * 4;
+		break;
+
+	case W25SIM_QUADREAD:
+		bits += 8 + sz * 2;
+		break;
+	}
+
+	simclock_advance((uint64_t) dev->tcmd * 1000
+		+ bits * 1000000000 / clock);
+}
+
+static void w25sim_sync(struct w25sim_device *dev, size_t addr,
+	size_t sz)
+{
+	if (dev->file == NULL)
+		return;
+
+	fseek(dev->file, addr, SEEK_SET);
+	fwrite(dev->mem + addr, 1, sz, dev->file);
+	fflush(dev->file);
+}
+
+// xorshift, so fault injection does not change rand() sequence
+// used by benchmarks
+static uint32_t w25sim_random(struct w25sim_device *dev)
+{
+	dev->seed ^= dev->seed << 13;
+	dev->seed ^= dev->seed >> 17;
+	dev->seed ^= dev->seed << 5;
+
+	return dev->seed;
+}
+
+// distance in bits to next flip, uniformly distributed around
+// 1000000 / rate
+static uint64_t w25sim_flipgap(struct w25sim_device *dev, uint32_t rate)
+{
+	return w25sim_random(dev) % (2000000 / rate) + 1;
+}
+
+static void w25sim_flip(struct w25sim_device *dev, uint8_t *data,
+	size_t sz, uint32_t rate, uint64_t *next)
+{
+	uint64_t bit;
+
+	if (rate == 0)
+		return;
+
+	if (*next == 0)
+		*next = w25sim_flipgap(dev, rate);
+
+	for (bit = *next - 1; bit < (uint64_t) sz * 8;
+			bit += w25sim_flipgap(dev, rate)) {
+		data[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	*next = bit - (uint64_t) sz * 8 + 1;
+}
+
+static int w25sim_iscut(struct w25sim_device *dev)
+{
+	return (++dev->opcount == dev->cutat);
+}
+
+static int w25sim_cut(struct w25sim_device *dev)
+{
+	dev->poweroff = 1;
+
+	if (dev->powercut != NULL)
+		dev->powercut(dev->powercutarg);
+
+	return (-1);
+}
+
+// interrupted erase leaves some bytes erased and some only
+// partially, with random bits still programmed
+static void w25sim_parterase(struct w25sim_device *dev, size_t addr,
+	size_t sz)
+{
+	size_t n, i;
+
+	n = w25sim_random(dev) % (sz + 1);
+
+	memset(dev->mem + addr, 0xff, n);
+
+	for (i = n; i < sz; ++i)
+		dev->mem[addr + i] |= w25sim_random(dev);
+
+	w25sim_sync(dev, addr, sz);
+}
+
+static int w25sim_waitwrite(struct w25sim_device *dev)
+{
+	uint64_t start;
+
+	start = simclock_now();
+
+	w25sim_transfer(dev, 2);
+
+	simclock_waituntil(dev->busyuntil);
+
+	dev->stat.busytime += (simclock_now() - start) / 1000;
+
+	return 0;
+}
+
+static int w25sim_blockprotect(struct w25sim_device *dev)
+{
+	w25sim_transfer(dev, 1);
+	w25sim_transfer(dev, 2);
+
+	return 0;
+}
+
+static int w25sim_finish(struct w25sim_device *dev)
+{
+	if (dev->pending == W25SIM_NONE)
+		return 0;
+
+	w25sim_waitwrite(dev);
+
+	// write disable
+	w25sim_transfer(dev, 1);
+
+	if (dev->unlocked == 0)
+		w25sim_blockprotect(dev);
+
+	dev->pending = W25SIM_NONE;
+
+	return 0;
+}
+
+static int w25sim_unlock(struct w25sim_device *dev)
+{
+	if (dev->unlocked++ == 0 && dev->pending == W25SIM_NONE) {
+		w25sim_waitwrite(dev);
+		w25sim_blockprotect(dev);
+	}
+
+	return 0;
+}
+
+static int w25sim_lock(struct w25sim_device *dev)
+{
+	if (dev->unlocked > 0 && --dev->unlocked == 0
+			&& dev->pending == W25SIM_NONE) {
+		w25sim_waitwrite(dev);
+		w25sim_blockprotect(dev);
+	}
+
+	return 0;
+}
+
+// returns simulated time, that is left of suspended erase, or 0 if
+// there was nothing to suspend
+static uint64_t w25sim_suspend(struct w25sim_device *dev, size_t addr,
+	size_t sz)
+{
+	uint64_t left;
+
+	if (dev->pending == W25SIM_NONE)
+		return 0;
+
+	if (dev->pending == W25SIM_PROGRAM || !dev->suspend || (addr < dev->pendaddr + dev->pendsize
+			&& addr + sz > dev->pendaddr)) {
+		w25sim_finish(dev);
+		return 0;
+	}
+
+	// status read
+	w25sim_transfer(dev, 2);
+
+	simclock_waituntil(dev->resumed + W25SIM_TRS * 1000);
+
+	if (simclock_now() >= dev->busyuntil) {
+		w25sim_finish(dev);
+		return 0;
+	}
+
+	w25sim_transfer(dev, 1);
+	simclock_advance(W25SIM_TSUS * 1000);
+	w25sim_transfer(dev, 2);
+
+	dev->stat.suspends++;
+
+	left = (dev->busyuntil > simclock_now())
+		? dev->busyuntil - simclock_now() : 1;
+
+	dev->busyuntil = simclock_now();
+
+	return left;
+}
+
+static void w25sim_resume(struct w25sim_device *dev, uint64_t left)
+{
+	w25sim_transfer(dev, 1);
+
+	dev->busyuntil = simclock_now() + left;
+	dev->resumed = simclock_now();
+}
+
+static int w25sim_startwrite(struct w25sim_device *dev)
+{
+	w25sim_finish(dev);
+
+	if (dev->unlocked == 0)
+		w25sim_blockprotect(dev);
+
+	// write enable
+	w25sim_transfer(dev, 1);
+
+	return 0;
+}
+
+static int w25sim_endwrite(struct w25sim_device *dev, uint32_t t)
+{
+	dev->busyuntil = simclock_now() + (uint64_t) t * 1000;
+
+	w25sim_waitwrite(dev);
+
+	// write disable
+	w25sim_transfer(dev, 1);
+
+	if (dev->unlocked == 0)
+		w25sim_blockprotect(dev);
+
+	return 0;
+}
+
+// program or erase is left running like in w25.c
+static int w25sim_leave(struct w25sim_device *dev, int op, size_t addr,
+	size_t sz, uint32_t t)
+{
+	dev->busyuntil = simclock_now() + (uint64_t) t * 1000;
+
+	dev->pending = op;
+	dev->pendaddr = addr;
+	dev->pendsize = sz;
+	dev->resumed = simclock_now();
+
+	return 0;
+}
+
+// total size of iovcnt pieces
+static size_t w25sim_iovsize(const struct bdev_iovec *iov, int iovcnt)
+{
+	size_t sz;
+	int i;
+
+	sz = 0;
+	for (i = 0; i < iovcnt; ++i)
+		sz += iov[i].len;
+
+	return sz;
+}
+
+// pieces come in one transfer, so command and address are sent once
+static int w25sim_readv(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct w25sim_device *dev;
+	uint64_t left;
+	uint8_t *data;
+	size_t sz, p, i;
+	int j;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	sz = w25sim_iovsize(iov, iovcnt);
+
+	TRACE_ENTER(TRACE_W25READ, dev - devs, addr, sz);
+
+	left = w25sim_suspend(dev, addr, sz);
+
+	w25sim_readtransfer(dev, sz);
+
+	if (left != 0)
+		w25sim_resume(dev, left);
+
+	dev->stat.reads++;
+	dev->stat.readbytes += sz;
+
+	p = addr;
+	for (j = 0; j < iovcnt; ++j) {
+		data = iov[j].base;
+
+		for (i = 0; i < iov[j].len; ++i, ++p)
+			data[i] = dev->mem[p % dev->totalsize];
+
+		w25sim_flip(dev, data, iov[j].len, dev->readflips,
+			&(dev->nextreadflip));
+	}
+
+	TRACE_LEAVE(TRACE_W25READ, dev - devs, addr, sz);
+
+	return 0;
+}
+
+static int w25sim_read(void *d, size_t addr, void *data, size_t sz)
+{
+	struct bdev_iovec iov;
+
+	iov.base = data;
+	iov.len = sz;
+
+	return w25sim_readv(d, addr, &iov, 1);
+}
+
+// page program, write is already enabled
+static int w25sim_program(struct w25sim_device *dev, size_t addr,
+	const void *data, size_t sz)
+{
+	size_t page, n, i;
+
+	w25sim_transfer(dev, 4 + dev->addr4 + sz);
+
+	// like a real chip, keep only last page worth of data and
+	// wrap around page boundary, NOR flash can only clear bits
+	if (sz > W25SIM_PAGESIZE) {
+		data += sz - W25SIM_PAGESIZE;
+		addr += sz - W25SIM_PAGESIZE;
+		sz = W25SIM_PAGESIZE;
+	}
+
+	dev->stat.programs++;
+	dev->stat.programbytes += sz;
+
+	addr %= dev->totalsize;
+	page = addr / W25SIM_PAGESIZE * W25SIM_PAGESIZE;
+
+	// power cut programs only some of the bytes, and the last
+	// of them partially
+	n = w25sim_iscut(dev) ? w25sim_random(dev) % (sz + 1) : sz;
+
+	for (i = 0; i < n; ++i) {
+		dev->mem[page + (addr + i) % W25SIM_PAGESIZE]
+			&= ((uint8_t *) data)[i];
+	}
+
+	if (n < sz) {
+		dev->mem[page + (addr + n) % W25SIM_PAGESIZE]
+			&= ((uint8_t *) data)[n] | w25sim_random(dev);
+	}
+
+	w25sim_flip(dev, dev->mem + page, W25SIM_PAGESIZE,
+		dev->programflips, &(dev->nextprogramflip));
+
+	w25sim_sync(dev, page, W25SIM_PAGESIZE);
+
+	if (n < sz)
+		return w25sim_cut(dev);
+
+	w25sim_leave(dev, W25SIM_PROGRAM, page, W25SIM_PAGESIZE, dev->tpp);
+
+	return 0;
+}
+
+static int w25sim_write(void *d, size_t addr, const void *data, size_t sz)
+{
+	struct w25sim_device *dev;
+	int r;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	TRACE_ENTER(TRACE_W25WRITE, dev - devs, addr, sz);
+
+	w25sim_startwrite(dev);
+
+	r = w25sim_program(dev, addr, data, sz);
+
+	TRACE_LEAVE(TRACE_W25WRITE, dev - devs, addr, sz);
+
+	return r;
+}
+
+// pieces are gathered into one buffer, program of the chip takes
+// the same time as if they were sent one after another
+static int w25sim_writev(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	uint8_t buf[w25sim_iovsize(iov, iovcnt)];
+	size_t p;
+	int i;
+
+	p = 0;
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(buf + p, iov[i].base, iov[i].len);
+		p += iov[i].len;
+	}
+
+	return w25sim_write(d, addr, buf, p);
+}
+
+static int w25sim_eraseall(void *d)
+{
+	struct w25sim_device *dev;
+	size_t i;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	w25sim_startwrite(dev);
+
+	w25sim_transfer(dev, 1);
+
+	dev->stat.chiperases++;
+
+	for (i = 0; i < dev->totalsize / W25SIM_SECTORSIZE; ++i)
+		dev->erasecount[i]++;
+
+	if (w25sim_iscut(dev)) {
+		w25sim_parterase(dev, 0, dev->totalsize);
+		return w25sim_cut(dev);
+	}
+
+	memset(dev->mem, 0xff, dev->totalsize);
+	w25sim_sync(dev, 0, dev->totalsize);
+
+	w25sim_endwrite(dev, dev->tce);
+
+	return 0;
+}
+
+static int w25sim_erasesector(void *d, size_t addr)
+{
+	struct w25sim_device *dev;
+	int r;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	TRACE_ENTER(TRACE_W25ERASESECTOR, dev - devs, addr, W25SIM_SECTORSIZE);
+
+	w25sim_startwrite(dev);
+
+	w25sim_transfer(dev, 4 + dev->addr4);
+
+	dev->stat.erases++;
+
+	addr = addr % dev->totalsize / W25SIM_SECTORSIZE
+		* W25SIM_SECTORSIZE;
+
+	dev->erasecount[addr / W25SIM_SECTORSIZE]++;
+
+	if (w25sim_iscut(dev)) {
+		w25sim_parterase(dev, addr, W25SIM_SECTORSIZE);
+		r = w25sim_cut(dev);
+	} else {
+		memset(dev->mem + addr, 0xff, W25SIM_SECTORSIZE);
+		w25sim_sync(dev, addr, W25SIM_SECTORSIZE);
+
+		r = w25sim_leave(dev, W25SIM_ERASE, addr, W25SIM_SECTORSIZE,
+			dev->tse);
+	}
+
+	TRACE_LEAVE(TRACE_W25ERASESECTOR, dev - devs, addr, W25SIM_SECTORSIZE);
+
+	return r;
+}
+
+static int w25sim_eraserange(void *d, size_t addr, size_t sz)
+{
+	struct w25sim_device *dev;
+	size_t a, end, n, s;
+	uint32_t t;
+	int r;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	if (addr % W25SIM_SECTORSIZE || sz % W25SIM_SECTORSIZE
+			|| addr + sz > dev->totalsize)
+		return (-1);
+
+	TRACE_ENTER(TRACE_W25ERASERANGE, dev - devs, addr, sz);
+
+	w25sim_unlock(dev);
+
+	r = 0;
+
+	for (a = addr, end = addr + sz; a < end; a += n) {
+		if (a % W25SIM_BLOCKSIZE == 0 && end - a >= W25SIM_BLOCKSIZE) {
+			n = W25SIM_BLOCKSIZE;
+			t = dev->tbe64;
+		} else if (a % W25SIM_HALFBLOCKSIZE == 0
+				&& end - a >= W25SIM_HALFBLOCKSIZE
+				&& !dev->addr4) {
+			n = W25SIM_HALFBLOCKSIZE;
+			t = dev->tbe32;
+		} else {
+			n = W25SIM_SECTORSIZE;
+			t = dev->tse;
+		}
+
+		w25sim_startwrite(dev);
+
+		w25sim_transfer(dev, 4 + dev->addr4);
+
+		if (n == W25SIM_SECTORSIZE)
+			dev->stat.erases++;
+		else
+			dev->stat.blockerases++;
+
+		for (s = a; s < a + n; s += W25SIM_SECTORSIZE)
+			dev->erasecount[s / W25SIM_SECTORSIZE]++;
+
+		if (w25sim_iscut(dev)) {
+			w25sim_parterase(dev, a, n);
+			r = w25sim_cut(dev);
+			break;
+		}
+
+		memset(dev->mem + a, 0xff, n);
+		w25sim_sync(dev, a, n);
+
+		w25sim_leave(dev, W25SIM_ERASE, a, n, t);
+	}
+
+	// chip without power keeps nothing, w25sim_poweron() resets
+	// the session
+	if (!dev->poweroff)
+		w25sim_lock(dev);
+
+	TRACE_LEAVE(TRACE_W25ERASERANGE, dev - devs, addr, sz);
+
+	return r;
+}
+
+// pages in one write session, next one is sent when the previous
+// one is done, like in w25.c
+static int w25sim_writesector(void *d, size_t addr, const void *data,
+	size_t sz)
+{
+	struct w25sim_device *dev;
+	size_t i, n;
+	int r;
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	w25sim_finish(dev);
+	w25sim_unlock(dev);
+
+	r = 0;
+
+	for (i = 0; i < sz && r == 0; i += n) {
+		n = min(W25SIM_PAGESIZE, sz - i);
+
+		TRACE_ENTER(TRACE_W25WRITE, dev - devs, addr + i, n);
+
+		if (dev->pending != W25SIM_NONE)
+			w25sim_waitwrite(dev);
+
+		dev->pending = W25SIM_NONE;
+
+		// write enable
+		w25sim_transfer(dev, 1);
+
+		r = w25sim_program(dev, addr + i, data + i, n);
+
+		TRACE_LEAVE(TRACE_W25WRITE, dev - devs, addr + i, n);
+	}
+
+	if (!dev->poweroff)
+		w25sim_lock(dev);
+
+	return r;
+}
+
+static int w25sim_ioctl(void *d, int req, ...)
+{
+	struct w25sim_device *dev;
+	va_list args;
+	int r;
+
+	dev = (struct w25sim_device *) d;
+
+	va_start(args, req);
+
+	r = 0;
+
+	switch (req) {
+	case BDEV_GETSTAT:
+		memmove(va_arg(args, struct bdevstat *), &(dev->stat),
+			sizeof(struct bdevstat));
+		break;
+
+	case BDEV_RESETSTAT:
+		memset(&(dev->stat), 0, sizeof(struct bdevstat));
+		break;
+
+	case BDEV_BADREAD:
+		dev->stat.retries++;
+		break;
+
+	case BDEV_GETERASECOUNT:
+		{
+			size_t addr;
+
+			addr = va_arg(args, size_t) % dev->totalsize;
+
+			*(va_arg(args, uint32_t *))
+				= dev->erasecount[addr / W25SIM_SECTORSIZE];
+		}
+		break;
+
+	case BDEV_SYNCWEAR:
+		break;
+
+	case BDEV_UNLOCK:
+		r = dev->poweroff ? -1 : w25sim_unlock(dev);
+		break;
+
+	case BDEV_LOCK:
+		r = dev->poweroff ? -1 : w25sim_lock(dev);
+		break;
+
+	case BDEV_BUSY:
+		r = (dev->pending != W25SIM_NONE
+			&& simclock_now() < dev->busyuntil);
+		break;
+
+	case BDEV_GETCLOCK:
+		*(va_arg(args, uint32_t *)) = dev->spiclock;
+		break;
+
+	default:
+		r = -1;
+	}
+
+	va_end(args);
+
+	return r;
+}
+
+static int w25sim_open(struct w25sim_device *dev)
+{
+	size_t r;
+
+	if ((dev->mem = malloc(dev->totalsize)) == NULL)
+		return (-1);
+
+	memset(dev->mem, 0xff, dev->totalsize);
+
+	dev->erasecount = calloc(dev->totalsize / W25SIM_SECTORSIZE,
+		sizeof(uint32_t));
+	if (dev->erasecount == NULL)
+		return (-1);
+
+	if (dev->path == NULL)
+		return 0;
+
+	if ((dev->file = fopen(dev->path, "r+b")) == NULL) {
+		if ((dev->file = fopen(dev->path, "w+b")) == NULL)
+			return (-1);
+	}
+
+	r = fread(dev->mem, 1, dev->totalsize, dev->file);
+
+	// grow short or new image to full chip size with erased bytes
+	if (r < dev->totalsize)
+		w25sim_sync(dev, r, dev->totalsize - r);
+
+	return 0;
+}
+
+// time t in us as 5-bit count and 2-bit unit index, like SFDP keeps
+// it: (count + 1) * unit, rounded up
+static uint32_t w25sim_sfdptime(uint32_t t, const uint32_t *unit,
+	int units)
+{
+	uint32_t count;
+	int u;
+
+	for (u = 0; u < units - 1; ++u) {
+		if ((t + unit[u] - 1) / unit[u] <= 32)
+			break;
+	}
+
+	count = (t + unit[u] - 1) / unit[u];
+	count = (count > 32) ? 32 : ((count > 0) ? count : 1);
+
+	return (count - 1) | (u << 5);
+}
+
+// SFDP of the simulated device: header, one parameter header and
+// JESD216B Basic Flash Parameter Table, made from device settings
+static void w25sim_sfdpimage(struct w25sim_device *dev, uint32_t *img)
+{
+	const uint32_t eraseunit[] = { 1000, 16000, 128000, 1000000 };
+	const uint32_t programunit[] = { 8, 64 };
+	const uint32_t chipunit[] = { 16000, 256000, 4000000, 64000000 };
+	uint32_t *dw;
+
+	memset(img, 0, W25SIM_SFDPSIZE);
+
+	img[0] = SFDP_SIGNATURE;
+	img[1] = 0xff000106;
+	img[2] = (16 << 24) | 0x010600;
+	img[3] = (0xff << 24) | 0x10;
+
+	dw = img + 4;
+
+	// 4kB erase, 1-1-2 and 1-1-4 reads, 3-byte addresses (3 or 4
+	// on bigger chips), 0x75 and 0x7a suspend and resume
+	dw[0] = 0x01 | (0x20 << 8) | (1 << 16) | (1 << 22);
+
+	if (dev->totalsize > W25SIM_ADDR3SIZE)
+		dw[0] |= 1 << 17;
+
+	dw[1] = dev->totalsize * 8 - 1;
+	dw[2] = (0x6b << 24) | (8 << 16);
+	dw[3] = (0x3b << 8) | 8;
+
+	dw[7] = 12 | (0x20 << 8) | (15 << 16) | (0x52 << 24);
+	dw[8] = 16 | (0xd8 << 8);
+
+	dw[9] = (w25sim_sfdptime(dev->tse, eraseunit, 4) << 4)
+		| (w25sim_sfdptime(dev->tbe32, eraseunit, 4) << 11)
+		| (w25sim_sfdptime(dev->tbe64, eraseunit, 4) << 18);
+
+	dw[10] = (8 << 4)
+		| (w25sim_sfdptime(dev->tpp, programunit, 2) << 8)
+		| (w25sim_sfdptime(dev->tce, chipunit, 4) << 24);
+
+	dw[11] = dev->suspend ? 0 : 0x80000000;
+	dw[12] = (0x75 << 24) | (0x7a << 16) | (0x75 << 8) | 0x7a;
+}
+
+static int w25sim_readsfdp(void *d, size_t addr, void *data, size_t sz)
+{
+	struct w25sim_device *dev;
+	uint32_t img[W25SIM_SFDPSIZE / sizeof(uint32_t)];
+
+	dev = (struct w25sim_device *) d;
+
+	if (dev->poweroff)
+		return (-1);
+
+	w25sim_transfer(dev, 5 + sz);
+
+	w25sim_sfdpimage(dev, img);
+
+	// like the chip, return 0xff past the SFDP image
+	memset(data, 0xff, sz);
+
+	if (addr < W25SIM_SFDPSIZE) {
+		memmove(data, (uint8_t *) img + addr,
+			min(sz, W25SIM_SFDPSIZE - addr));
+	}
+
+	return 0;
+}
+
+static int initdevice(void *is, struct bdevice *dev)
+{
+	struct w25sim_device *sd;
+	struct sfdp_info info;
+	int i;
+
+	if (devcount >= W25SIM_MAXDEVS)
+		return (-1);
+
+	sd = devs + devcount;
+
+	memmove(sd, is, sizeof(struct w25sim_device));
+
+	sd->mem = NULL;
+	sd->file = NULL;
+	sd->erasecount = NULL;
+	sd->busyuntil = 0;
+	sd->opcount = 0;
+	sd->poweroff = 0;
+	sd->unlocked = 0;
+	sd->pending = W25SIM_NONE;
+	sd->nextreadflip = sd->nextprogramflip = 0;
+
+	memset(&(sd->stat), 0, sizeof(struct bdevstat));
+
+	if (w25sim_open(sd) < 0)
+		return (-1);
+
+	// geometry is discovered like w25.c does it
+	if (sfdp_parse(w25sim_readsfdp, sd, &info) < 0)
+		return (-1);
+
+	if (sd->readmode == W25SIM_DUALREAD && info.dualread.opcode == 0)
+		sd->readmode = W25SIM_FASTREAD;
+
+	if (sd->readmode == W25SIM_QUADREAD && info.quadread.opcode == 0)
+		sd->readmode = W25SIM_FASTREAD;
+
+	sd->suspend = (info.suspendcmd != 0);
+
+	// 32kB block erase has no 4-byte address opcode, so it's not
+	// used then, like in w25.c
+	sd->addr4 = (info.addr4 && info.totalsize > W25SIM_ADDR3SIZE);
+
+	sprintf(dev->name, "%s%lu", "flash", devcount);
+
+	dev->priv = sd;
+
+	dev->read = w25sim_read;
+	dev->write = w25sim_write;
+	dev->ioctl = w25sim_ioctl;
+	dev->eraseall = w25sim_eraseall;
+	dev->erasesector = w25sim_erasesector;
+	dev->eraserange = w25sim_eraserange;
+	dev->writesector = w25sim_writesector;
+	dev->readv = w25sim_readv;
+	dev->writev = w25sim_writev;
+
+	dev->writesize = info.pagesize;
+	dev->sectorsize = W25SIM_SECTORSIZE;
+	dev->totalsize = info.totalsize;
+	dev->programtime = info.programtime;
+	dev->erasetime = 0;
+
+	for (i = 0; i < SFDP_ERASETYPES; ++i) {
+		if (info.erase[i].size == W25SIM_SECTORSIZE)
+			dev->erasetime = info.erase[i].time;
+	}
+
+	devcount++;
+
+	return 0;
+}
+
+int w25sim_defaultdevice(struct w25sim_device *dev, const char *path)
+{
+	dev->path = path;
+	dev->totalsize = W25SIM_TOTALSIZE;
+
+	dev->spiclock = W25SIM_SPICLOCK;
+	dev->tcmd = W25SIM_TCMD;
+	dev->readmode = W25SIM_READ;
+
+	dev->tpp = W25SIM_TPP;
+	dev->tse = W25SIM_TSE;
+	dev->tbe32 = W25SIM_TBE32;
+	dev->tbe64 = W25SIM_TBE64;
+	dev->tce = W25SIM_TCE;
+	dev->suspend = 1;
+
+	dev->cutat = 0;
+	dev->powercut = NULL;
+	dev->powercutarg = NULL;
+
+	dev->readflips = 0;
+	dev->programflips = 0;
+	dev->seed = 1;
+
+	return 0;
+}
+
+int w25sim_readmode(const char *name)
+{
+	int m;
+
+	for (m = W25SIM_READ; m <= W25SIM_QUADREAD; ++m) {
+		if (strcmp(name, w25sim_strreadmode(m)) == 0)
+			return m;
+	}
+
+	return (-1);
+}
+
+const char *w25sim_strreadmode(enum W25SIM_READMODE mode)
+{
+	const char *W25SIM_READMODENAME[] = {
+		"read", "fast", "dual", "quad"
+	};
+
+	if (mode > W25SIM_QUADREAD)
+		return "unknown";
+
+	return W25SIM_READMODENAME[mode];
+}
+
+int w25sim_poweron(struct w25sim_device *dev)
+{
+	// operation that was in progress is aborted with power loss
+	dev->busyuntil = simclock_now();
+	dev->opcount = 0;
+	dev->poweroff = 0;
+
+	// volatile status register bits are reloaded, so protection
+	// is back on
+	dev->unlocked = 0;
+	dev->pending = W25SIM_NONE;
+
+	return 0;
+}
+
+int w25sim_getdriver(struct driver *driver)
+{
+	driver->initdevice = initdevice;
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef W25SIM_H
+#define W25SIM_H
+
+#include "driver.h"
+
+#define W25SIM_PAGESIZE 256
+#define W25SIM_SECTORSIZE 4096
+#define W25SIM_HALFBLOCKSIZE (4096 * 8)
+#define W25SIM_BLOCKSIZE (4096 * 16)
+#define W25SIM_TOTALSIZE (1024 * 1024 * 16)
+
+// bigger chips take 4-byte addresses, like W25Q256
+#define W25SIM_ADDR3SIZE (1024 * 1024 * 16)
+
+#define W25SIM_MAXDEVS 4
+
+// SFDP header, parameter header and 16 dword BFPT
+#define W25SIM_SFDPSIZE 0x50
+
+// typical W25Q128JV timings
+#define W25SIM_SPICLOCK	1000000
+#define W25SIM_TCMD	5
+#define W25SIM_TPP	400
+#define W25SIM_TSE	45000
+#define W25SIM_TBE32	120000
+#define W25SIM_TBE64	150000
+#define W25SIM_TCE	40000000
+
+// erase suspend latency and minimum erase time between resume and
+// next suspend
+#define W25SIM_TSUS	20
+#define W25SIM_TRS	20
+
+// maximum clock of 0x03 Read, other reads work up to full clock
+#define W25SIM_READCLOCK 50000000
+
+// same read commands as W25_READMODE of w25.h: 0x03 Read, 0x0b Fast
+// Read, 0x3b Dual and 0x6b Quad Output Fast Read
+enum W25SIM_READMODE {
+	W25SIM_READ		= 0x00,
+	W25SIM_FASTREAD		= 0x01,
+	W25SIM_DUALREAD		= 0x02,
+	W25SIM_QUADREAD		= 0x03
+};
+
+// operation left running, like W25_PENDING of w25.h
+enum W25SIM_PENDING {
+	W25SIM_NONE		= 0x00,
+	W25SIM_PROGRAM		= 0x01,
+	W25SIM_ERASE		= 0x02
+};
+
+struct w25sim_device {
+	// backing file, NULL to keep flash content only in RAM
+	const char *path;
+	size_t totalsize;
+
+	// commands take 4-byte address, set at init
+	int addr4;
+
+	// SPI clock in Hz and per-transaction overhead in us
+	uint32_t spiclock;
+	uint32_t tcmd;
+
+	enum W25SIM_READMODE readmode;
+
+	// page program, sector erase, 32kB and 64kB block erase and
+	// chip erase times in us
+	uint32_t tpp;
+	uint32_t tse;
+	uint32_t tbe32;
+	uint32_t tbe64;
+	uint32_t tce;
+
+	// erase suspend is supported, reads of other addresses suspend
+	// running erase instead of waiting for it like in w25.c
+	int suspend;
+
+	uint8_t *mem;
+	void *file;
+	uint64_t busyuntil;
+
+	struct bdevstat stat;
+	uint32_t *erasecount;
+
+	// depth of BDEV_UNLOCK sessions, like in w25.c
+	int unlocked;
+
+	// program or erase left running like in w25.c, W25_PENDING
+	// values; simulated time of the last resume
+	int pending;
+	size_t pendaddr;
+	size_t pendsize;
+	uint64_t resumed;
+
+	// fault injection: power is cut in the middle of cutat-th
+	// program or erase operation since power on (0 to never cut),
+	// then powercut(powercutarg) is called and device ignores all
+	// commands until w25sim_poweron()
+	uint32_t cutat;
+	void (*powercut)(void *arg);
+	void *powercutarg;
+
+	// random bit flips per million bits of data returned by read
+	// (transient) or of programmed pages (persistent)
+	uint32_t readflips;
+	uint32_t programflips;
+	uint32_t seed;
+
+	uint32_t opcount;
+	int poweroff;
+	uint64_t nextreadflip;
+	uint64_t nextprogramflip;
+};
+
+int w25sim_defaultdevice(struct w25sim_device *dev, const char *path);
+
+int w25sim_poweron(struct w25sim_device *dev);
+
+int w25sim_readmode(const char *name);
+
+const char *w25sim_strreadmode(enum W25SIM_READMODE mode);
+
+int w25sim_getdriver(struct driver *driver);
+
+#endif
@@ -9,8 +9,12 @@
 #include "sfs.h"
 #include "rfs.h"
 #include "w25.h"
+#include "stripe.h"
+#include "mirror.h"
 #include "uartterm.h"
 #include "calls.h"
+#include "trace.h"
+#include "stackprof.h"
 
 #define PRESCALER 72
 #define TIMPERIOD 0xffff
@@ -18,10 +22,15 @@
 
 #define ITDUR 10
 
+#define WEARHOTTEST 8
+#define WEARBUCKETS 32
+
 #define OUTPUTPINSA (GPIO_PIN_4)
 #define OUTPUTPINSB (GPIO_PIN_3)
 
 SPI_HandleTypeDef hspi1;
+DMA_HandleTypeDef hdma_spi1_rx;
+DMA_HandleTypeDef hdma_spi1_tx;
 
 TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim2;
@@ -34,11 +43,15 @@ struct filesystem fs[8];
 
 struct bdevice *curdev;
 
-// for heap test
-void *_sbrk(ptrdiff_t incr);
+// number of W25 chips found, they are the first devices
+static int flashcount;
+
+// stripe or mirror of both chips made by mkraid, NULL before that
+static struct bdevice *raiddev;
 
 void systemclock_config(void);
 static void gpio_init(void);
+static void dma_init(void);
 static void spi1_init(void);
 static void tim1_init(void);
 static void tim2_init(void);
@@ -63,6 +76,29 @@ int printhelp()
 	ut_write("\t%-23s%-32s\n\r",
 		"wd [addr] [str]","write string [str] into [addr]");
 
+	ut_write("\t%-23s%-32s\n\r",
+		"iostat {reset}","show (or reset) I/O counters of devices");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"wear {sync}","show erase counts histogram (or save counters)");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"trace {on|off|clear}",
+		"dump trace records (or enable, disable, clear tracing)");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"stack {on|off|reset}",
+		"show deepest stack use of VFS calls (or control profiler)");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"heapstat {reset}","show (or reset) heap allocator counters");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"spitime {count}","time status poll and small read on flash");
+
+	ut_write("\t%-23s%-32s\n\r",
+		"mkraid [stripe|mirror]","make device of both unmounted chips");
+
 	ut_write("\r\nfilesystem commands:\n\r");
 	
 	ut_write("\t%-23s%-32s\n\r",
@@ -149,23 +185,132 @@ int printhelp()
 	return 0;
 }
 
+static struct bdevice *finddevice(const char *name)
+{
+	struct bdevice *d;
+
+	for (d = dev; d < dev + 8 && d->name[0] != '\0'; ++d) {
+		if (strcmp(name, d->name) == 0)
+			return d;
+	}
+
+	return NULL;
+}
+
 int setdevice(const char **toks)
 {
-	if (strcmp(toks[1], dev[0].name) == 0)
-		curdev = dev + 0;
-	else if (strcmp(toks[1], dev[1].name) == 0)
-		curdev = dev + 1;
-	else {
+	struct bdevice *d;
+
+	if ((d = finddevice(toks[1])) == NULL) {
 		ut_write("unknown device %s\n\r", toks[1]);
 		
 		return 0;
 	}
 
+	curdev = d;
+
 	ut_write("device %s was set\n\r", toks[1]);
 	
 	return 0;
 }
 
+// d is mounted somewhere in VFS
+static int ismounted(struct bdevice *d)
+{
+	char buf[256];
+	const char *list[MOUNTMAX];
+	const char **p;
+	size_t len;
+
+	if (mountlist(list, buf, sizeof(buf)) < 0)
+		return 0;
+
+	len = strlen(d->name);
+
+	for (p = list; *p != NULL; ++p) {
+		if (strncmp(*p, d->name, len) == 0 && (*p)[len] == ' ')
+			return 1;
+	}
+
+	return 0;
+}
+
+// chips and the device made of them hold different filesystems on
+// the same flash, so only one of them can be mounted at once
+static int chipsmounted(struct bdevice *d)
+{
+	if (raiddev == NULL)
+		return 0;
+
+	if (d == raiddev)
+		return (ismounted(dev + 0) || ismounted(dev + 1));
+
+	if (d == dev + 0 || d == dev + 1)
+		return ismounted(raiddev);
+
+	return 0;
+}
+
+// make stripe or mirror device of both chips, format through it
+// destroys filesystems on them, so they must not be mounted
+int mkraid(const char **toks)
+{
+	struct stripe_device s;
+	struct mirror_device m;
+	int r;
+
+	if (flashcount != 2) {
+		ut_write("mkraid: both chips are needed\n\r");
+
+		return 0;
+	}
+
+	if (raiddev != NULL) {
+		ut_write("mkraid: %s is already made\n\r", raiddev->name);
+
+		return 0;
+	}
+
+	if (ismounted(dev + 0) || ismounted(dev + 1)) {
+		ut_write("mkraid: chip is mounted\n\r");
+
+		return 0;
+	}
+
+	if (toks[1] != NULL && strcmp(toks[1], "stripe") == 0) {
+		stripe_getdriver(drivers + 1);
+
+		s.members[0] = dev + 0;
+		s.members[1] = dev + 1;
+		s.count = 2;
+		r = drivers[1].initdevice(&s, dev + flashcount);
+	}
+	else if (toks[1] != NULL && strcmp(toks[1], "mirror") == 0) {
+		mirror_getdriver(drivers + 1);
+
+		m.members[0] = dev + 0;
+		m.members[1] = dev + 1;
+		r = drivers[1].initdevice(&m, dev + flashcount);
+	}
+	else {
+		ut_write("mkraid: stripe or mirror\n\r");
+
+		return 0;
+	}
+
+	if (r < 0) {
+		ut_write("mkraid: init failed\n\r");
+
+		return 0;
+	}
+
+	raiddev = dev + flashcount;
+
+	ut_write("device %s was made\n\r", raiddev->name);
+
+	return 0;
+}
+
 int devformat(const char **toks)
 {
 	size_t r;
@@ -227,6 +372,199 @@ int writedata(const char **toks)
 	return 0;
 }
 
+int iostat(const char **toks)
+{
+	struct bdevstat st;
+	struct bdevice *d;
+	uint32_t clk;
+
+	for (d = dev; d < dev + 8 && d->name[0] != '\0'; ++d) {
+		if (toks[1] != NULL && strcmp(toks[1], "reset") == 0) {
+			d->ioctl(d->priv, BDEV_RESETSTAT);
+			continue;
+		}
+
+		if (d->ioctl(d->priv, BDEV_GETSTAT, &st) < 0) {
+			ut_write("%s: no statistics\n\r", d->name);
+			continue;
+		}
+
+		ut_write("%s:\n\r", d->name);
+		ut_write("\treads: %lu (%lu bytes)\n\r",
+			st.reads, st.readbytes);
+		ut_write("\tpage programs: %lu (%lu bytes)\n\r",
+			st.programs, st.programbytes);
+		ut_write("\tsector erases: %lu\n\r", st.erases);
+		ut_write("\tblock erases: %lu\n\r", st.blockerases);
+		ut_write("\tchip erases: %lu\n\r", st.chiperases);
+		ut_write("\tbusy wait: %lu us\n\r", st.busytime);
+		ut_write("\tchecksum retries: %lu\n\r", st.retries);
+		ut_write("\tDMA transfers: %lu\n\r", st.dmatransfers);
+		ut_write("\terase suspends: %lu\n\r", st.suspends);
+
+		if (d->ioctl(d->priv, BDEV_GETCLOCK, &clk) == 0)
+			ut_write("\tSPI clock: %lu Hz\n\r", clk);
+	}
+
+	return 0;
+}
+
+int wear(const char **toks)
+{
+	uint32_t hist[WEARBUCKETS], hot[WEARHOTTEST], cnt;
+	size_t hotaddr[WEARHOTTEST], addr;
+	int b, i;
+
+	if (toks[1] != NULL && strcmp(toks[1], "sync") == 0) {
+		if (curdev->ioctl(curdev->priv, BDEV_SYNCWEAR) < 0)
+			ut_write("error: can't save erase counters\n\r");
+
+		return 0;
+	}
+
+	memset(hist, 0, sizeof(hist));
+	memset(hot, 0, sizeof(hot));
+
+	for (addr = 0; addr < curdev->totalsize;
+			addr += curdev->sectorsize) {
+		if (curdev->ioctl(curdev->priv, BDEV_GETERASECOUNT,
+				addr, &cnt) < 0) {
+			ut_write("%s: no erase counters\n\r", curdev->name);
+
+			return 0;
+		}
+
+		for (b = 0; b < WEARBUCKETS - 1 && (cnt >> b) != 0; ++b);
+
+		hist[b]++;
+
+		for (i = WEARHOTTEST - 1; i >= 0 && cnt > hot[i]; --i) {
+			if (i + 1 < WEARHOTTEST) {
+				hot[i + 1] = hot[i];
+				hotaddr[i + 1] = hotaddr[i];
+			}
+		}
+
+		if (++i < WEARHOTTEST) {
+			hot[i] = cnt;
+			hotaddr[i] = addr;
+		}
+	}
+
+	ut_write("erases: sectors\n\r");
+
+	for (b = 0; b < WEARBUCKETS; ++b) {
+		if (hist[b] == 0)
+			continue;
+
+		if (b == 0)
+			ut_write("%10s: %lu\n\r", "0", hist[b]);
+		else {
+			ut_write("%4lu-%-5lu: %lu\n\r", 1UL << (b - 1),
+				(1UL << b) - 1, hist[b]);
+		}
+	}
+
+	ut_write("hottest sectors:\n\r");
+
+	for (i = 0; i < WEARHOTTEST && hot[i] != 0; ++i)
+		ut_write("%8x: %lu\n\r", hotaddr[i], hot[i]);
+
+	return 0;
+}
+
+int spitime(const char **toks)
+{
+	uint32_t count, status, read, mhz;
+	int i;
+
+	count = 1000;
+
+	if (toks[1] != NULL)
+		sscanf(toks[1], "%lu", &count);
+	mhz = SystemCoreClock / 1000000;
+
+	for (i = 0; i < flashcount; ++i) {
+		if (w25_spitime(dev[i].priv, count, &status, &read) < 0) {
+			ut_write("error: wrong count\n\r");
+			return 0;
+		}
+
+		ut_write("%s: status %lu cycles (%lu.%02lu us), "
+			"%d byte read %lu cycles (%lu.%02lu us)\n\r",
+			dev[i].name, status, status / mhz,
+			status % mhz * 100 / mhz, W25_SPITIMEREAD, read,
+			read / mhz, read % mhz * 100 / mhz);
+	}
+
+	return 0;
+}
+
+int trace(const char **toks)
+{
+	struct trace_record r;
+	size_t i;
+
+	if (toks[1] != NULL) {
+		if (strcmp(toks[1], "on") == 0)
+			trace_enable(1);
+		else if (strcmp(toks[1], "off") == 0)
+			trace_enable(0);
+		else if (strcmp(toks[1], "clear") == 0)
+			trace_clear();
+		else
+			ut_write("error: unknown trace command\n\r");
+
+		return 0;
+	}
+
+	// raw records, decoded on host by host/tracedec
+	for (i = 0; i < trace_count(); ++i) {
+		trace_get(i, &r);
+
+		ut_write("%08lx %08lx %08lx %08lx\n\r",
+			r.time, r.event, r.addr, r.size);
+	}
+
+	return 0;
+}
+
+int stack(const char **toks)
+{
+	struct stackprof_stat st;
+	int i;
+
+	if (toks[1] != NULL) {
+		if (strcmp(toks[1], "on") == 0)
+			stackprof_enable(1);
+		else if (strcmp(toks[1], "off") == 0)
+			stackprof_enable(0);
+		else if (strcmp(toks[1], "reset") == 0)
+			stackprof_reset();
+		else
+			ut_write("error: unknown stack command\n\r");
+
+		return 0;
+	}
+
+	ut_write("%-8s %8s %8s\n\r", "call", "calls", "bytes");
+
+	for (i = 0; i < STACKPROF_CALLS; ++i) {
+		stackprof_get(i, &st);
+
+		if (st.calls == 0)
+			continue;
+
+		ut_write("%-8s %8lu %7lu%s\n\r", stackprof_strcall(i),
+			st.calls, st.maxdepth, st.overflow ? "+" : "");
+	}
+
+	ut_write("free between heap and stack: %lu bytes\n\r",
+		stackprof_free());
+
+	return 0;
+}
+
 int mntdevformat(const char **toks)
 {
 	int r;
@@ -459,16 +797,18 @@ int mounthandler(const char **toks)
 	struct bdevice *d;
 	int r;
 
-	if (strcmp(toks[1], dev[0].name) == 0)
-		d = dev + 0;
-	else if (strcmp(toks[1], dev[1].name) == 0)
-		d = dev + 1;
-	else {
+	if ((d = finddevice(toks[1])) == NULL) {
 		ut_write("unknown device %s\n\r", toks[1]);
 	
 		return 0;
 	}
 
+	if (chipsmounted(d)) {
+		ut_write("mount: chips of %s are mounted\n\r", toks[1]);
+
+		return 0;
+	}
+
 	if ((r = mount(d, toks[2], fs + 0)) < 0) {
 		ut_write("mount: %s\n\r", vfs_strerror(r));
 
@@ -653,55 +993,42 @@ int vfscd(const char **toks)
 	return 0;
 }
 
-int heaptest(const char **toks)
+int heapstat(const char **toks)
 {
-	char *p[256];
+	struct heapstat st;
 	int i;
-	
-	ut_write("initial break: %p\n\r", _sbrk(0));
 
-	for (i = 0; i < 128; ++i)
-		p[i] = malloc(32);
-
-	for (i = 0; i < 4; ++i)
-		p[128 + i] = malloc(1024);
-
-	for (i = 0; i < 132; ++i) {
-		ut_write("%p ", p[i] - 12);
-		
-		if (((i + 1) % 8) == 0)
-			ut_write("\n\r");
+	if (toks[1] != NULL && strcmp(toks[1], "reset") == 0) {
+		heap_resetstat();
+		return 0;
 	}
-	ut_write("\n\r");
-
-	ut_write("current break: %p\n\r", _sbrk(0));
 
-	for (i = 0; i < 132; ++i)
-		free(p[i]);
-	
-	ut_write("current break (after free): %p\n\r", _sbrk(0));
-	
-	for (i = 0; i < 128; ++i)
-		p[i] = malloc(32);
-	
-	for (i = 0; i < 4; ++i)
-		p[128 + i] = malloc(1024);
-	
-	for (i = 0; i < 132; ++i) {
-		ut_write("%p ", p[i] - 12);
-		
-		if (((i + 1) % 8) == 0)
-			ut_write("\n\r");
+	heap_getstat(&st);
+
+	ut_write("heap size: %lu bytes\n\r", st.heapsize);
+	ut_write("live: %lu bytes in %lu blocks, peak %lu bytes\n\r",
+		st.livebytes, st.livecount, st.peakbytes);
+	ut_write("free list: %lu blocks, %lu bytes, largest %lu bytes\n\r",
+		st.freecount, st.freebytes, st.largestfree);
+	ut_write("malloc: %lu, free: %lu, realloc: %lu (%lu in place)\n\r",
+		st.mallocs, st.frees, st.reallocs, st.inplace);
+	ut_write("free block searches: %lu, %lu us\n\r", st.searches,
+		(uint32_t) (st.searchcycles / (SystemCoreClock / 1000000)));
+
+	ut_write("allocation sizes:\n\r");
+
+	for (i = 0; i < HEAP_HISTSIZE; ++i) {
+		if (st.hist[i] == 0)
+			continue;
+
+		if (i < HEAP_HISTSIZE - 1)
+			ut_write("%7s%-5u: %lu\n\r", "<= ", 16 << i, st.hist[i]);
+		else {
+			ut_write("%7s%-5u: %lu\n\r", "> ", 16 << (i - 1),
+				st.hist[i]);
+		}
 	}
-	ut_write("\n\r");
-	
-	ut_write("current break: %p\n\r", _sbrk(0));
 
-	for (i = 0; i < 132; ++i)
-		free(p[i]);
-	
-	ut_write("current break (after free): %p\n\r", _sbrk(0));
-	
 	return 0;
 }
 
@@ -715,7 +1042,9 @@ int main(void)
 	tim1_init();
 	tim2_init();
 	usart1_init();
+	dma_init();
 	spi1_init();
+	trace_init();
 	flash_init();
 	rfs_init();
 	
@@ -727,9 +1056,19 @@ int main(void)
 	vfsinit();
 	ut_init(&huart1);
 
+	// chips, that completed program or erase, are write disabled
+	// and protected while terminal waits for input
+	ut_setidle(w25_idle);
+
 	ut_addcommand("sd",		setdevice);
 	ut_addcommand("rd",		readdata);
 	ut_addcommand("wd",		writedata);
+	ut_addcommand("iostat",		iostat);
+	ut_addcommand("wear",		wear);
+	ut_addcommand("trace",		trace);
+	ut_addcommand("stack",		stack);
+	ut_addcommand("spitime",	spitime);
+	ut_addcommand("mkraid",		mkraid);
 
 	ut_addcommand("f",		devformat);
 	ut_addcommand("i",		dump);
@@ -756,12 +1095,15 @@ int main(void)
 	ut_addcommand("ls",		listvfsdir);
 	ut_addcommand("cd",		vfscd);
 	
-	ut_addcommand("heaptest",	heaptest);
+	ut_addcommand("heapstat",	heapstat);
 
 	printhelp();
 
-	mount(dev + 0, "/", fs + 0);
-	mount(dev + 1, "/dev", fs + 0);
+	if (flashcount > 0)
+		mount(dev + 0, "/", fs + 0);
+
+	if (flashcount > 1)
+		mount(dev + 1, "/dev", fs + 0);
 	mount(NULL, "/tmp", fs + 1);
 	format("/tmp");
 	
@@ -834,6 +1176,17 @@ static void gpio_init(void)
 	HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 }
 
+static void dma_init(void)
+{
+	__HAL_RCC_DMA2_CLK_ENABLE();
+
+	HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+	HAL_NVIC_SetPriority(DMA2_Stream3_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+}
+
 static void spi1_init(void)
 {
 	hspi1.Instance = SPI1;
@@ -925,18 +1278,31 @@ static void usart1_init()
 static void flash_init()
 {
 	struct w25_device d;
+	int n;
 
 	w25_getdriver(drivers + 0);
 
+	n = 0;
+
 	d.hspi = &hspi1;
 	d.gpio = GPIOA;
 	d.pin = GPIO_PIN_4;
-	drivers[0].initdevice(&d, dev + 0);
+	d.readmode = W25_FASTREAD;
+	if (drivers[0].initdevice(&d, dev + n) == 0)
+		n++;
 
 	d.hspi = &hspi1;
 	d.gpio = GPIOB;
 	d.pin = GPIO_PIN_3;
-	drivers[0].initdevice(&d, dev + 1);
+	d.readmode = W25_FASTREAD;
+	if (drivers[0].initdevice(&d, dev + n) == 0)
+		n++;
+
+	flashcount = n;
+
+	// stripe and mirror of both chips are made by mkraid, they are
+	// mounted separately by default
+	raiddev = NULL;
 
 	curdev = dev;
 
@@ -0,0 +1,504 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "mirror.h"
+
+static struct mirror_device devs[MIRROR_MAXDEVS];
+static size_t devcount = 0;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// entry of bad sectors table for sector s, or NULL
+static struct mirror_bad *mirror_findbad(struct mirror_device *dev,
+	size_t s)
+{
+	int i;
+
+	for (i = 0; i < MIRROR_BADSECTORS; ++i) {
+		if (dev->bad[i].member >= 0 && dev->bad[i].sector == s)
+			return dev->bad + i;
+	}
+
+	return NULL;
+}
+
+// copy of sector s on member m is bad, if table is full, the oldest
+// entry is replaced
+static void mirror_setbad(struct mirror_device *dev, size_t s, int m)
+{
+	struct mirror_bad *b;
+
+	if ((b = mirror_findbad(dev, s)) == NULL) {
+		b = dev->bad + dev->badnext;
+		dev->badnext = (dev->badnext + 1) % MIRROR_BADSECTORS;
+	}
+
+	b->sector = s;
+	b->member = m;
+}
+
+// sectors from s0 to s1 are rewritten on both members
+static void mirror_clearbad(struct mirror_device *dev, size_t s0,
+	size_t s1)
+{
+	int i;
+
+	for (i = 0; i < MIRROR_BADSECTORS; ++i) {
+		if (dev->bad[i].sector >= s0 && dev->bad[i].sector < s1)
+			dev->bad[i].member = -1;
+	}
+}
+
+static int mirror_isbusy(struct mirror_device *dev, int m)
+{
+	return (dev->members[m]->ioctl(dev->members[m]->priv,
+		BDEV_BUSY) > 0);
+}
+
+// member to read sector s from: not the one with known bad copy,
+// then the one of the last read, if it was the same sector, so all
+// pieces of sector come from one copy and BDEV_BADREAD blames it,
+// then the one, that is idle, otherwise members in turn
+static int mirror_pick(struct mirror_device *dev, size_t s)
+{
+	struct mirror_bad *b;
+	int busy0, busy1;
+
+	if ((b = mirror_findbad(dev, s)) != NULL)
+		return !b->member;
+
+	if (s == dev->lastsector)
+		return dev->lastmember;
+
+	busy0 = mirror_isbusy(dev, 0);
+	busy1 = mirror_isbusy(dev, 1);
+
+	if (busy0 != busy1)
+		return busy0;
+
+	dev->next = !dev->next;
+
+	return dev->next;
+}
+
+// bytes from addr to the end of its sector, but not more than sz
+static size_t mirror_piece(struct mirror_device *dev, size_t addr,
+	size_t sz)
+{
+	return min(sz, dev->sectorsize - addr % dev->sectorsize);
+}
+
+static int mirror_read(void *d, size_t addr, void *data, size_t sz)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	size_t s, i, n;
+	int k;
+
+	dev = (struct mirror_device *) d;
+
+	for (i = 0; i < sz; i += n) {
+		n = mirror_piece(dev, addr + i, sz - i);
+		s = (addr + i) / dev->sectorsize;
+
+		k = mirror_pick(dev, s);
+		m = dev->members[k];
+
+		if (m->read(m->priv, addr + i, data + i, n) < 0) {
+			k = !k;
+			m = dev->members[k];
+
+			if (m->read(m->priv, addr + i, data + i, n) < 0)
+				return (-1);
+		}
+
+		dev->lastsector = s;
+		dev->lastmember = k;
+	}
+
+	return 0;
+}
+
+// total size of iovcnt pieces
+static size_t mirror_iovsize(const struct bdev_iovec *iov, int iovcnt)
+{
+	size_t sz;
+	int i;
+
+	sz = 0;
+	for (i = 0; i < iovcnt; ++i)
+		sz += iov[i].len;
+
+	return sz;
+}
+
+// pieces within one sector are read from one member in one transfer,
+// otherwise they are read one by one
+static int mirror_readv(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	size_t s, sz;
+	int i, k;
+
+	dev = (struct mirror_device *) d;
+
+	sz = mirror_iovsize(iov, iovcnt);
+
+	if (mirror_piece(dev, addr, sz) != sz) {
+		for (i = 0; i < iovcnt; ++i) {
+			if (mirror_read(dev, addr, iov[i].base,
+					iov[i].len) < 0)
+				return (-1);
+
+			addr += iov[i].len;
+		}
+
+		return 0;
+	}
+
+	s = addr / dev->sectorsize;
+
+	k = mirror_pick(dev, s);
+	m = dev->members[k];
+
+	if (m->readv(m->priv, addr, iov, iovcnt) < 0) {
+		k = !k;
+		m = dev->members[k];
+
+		if (m->readv(m->priv, addr, iov, iovcnt) < 0)
+			return (-1);
+	}
+
+	dev->lastsector = s;
+	dev->lastmember = k;
+
+	return 0;
+}
+
+// program page by page on both members: while program of a page on
+// one member runs, the same page is sent to another. Fails only if
+// both copies fail, sector, that failed on one member, is read from
+// another one.
+static int mirror_program(struct mirror_device *dev, size_t addr,
+	const void *data, size_t sz, int sector)
+{
+	struct bdevice *m;
+	size_t i, n, ws;
+	int k, failed, r;
+
+	ws = min(dev->members[0]->writesize, dev->members[1]->writesize);
+
+	for (i = 0; i < sz; i += n) {
+		n = min(sz - i, ws - (addr + i) % ws);
+		failed = 0;
+
+		for (k = 0; k < MIRROR_MEMBERS; ++k) {
+			m = dev->members[k];
+
+			r = sector
+				? m->writesector(m->priv, addr + i, data + i, n)
+				: m->write(m->priv, addr + i, data + i, n);
+
+			if (r < 0) {
+				mirror_setbad(dev, (addr + i) / dev->sectorsize,
+					k);
+				failed++;
+			}
+		}
+
+		if (failed == MIRROR_MEMBERS)
+			return (-1);
+	}
+
+	return 0;
+}
+
+static int mirror_write(void *d, size_t addr, const void *data, size_t sz)
+{
+	return mirror_program((struct mirror_device *) d, addr, data, sz, 0);
+}
+
+// pieces of one page go to both members in one transfer
+static int mirror_writev(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	size_t sz, ws;
+	int i, k, failed;
+
+	dev = (struct mirror_device *) d;
+
+	sz = mirror_iovsize(iov, iovcnt);
+	ws = min(dev->members[0]->writesize, dev->members[1]->writesize);
+
+	if (sz > ws - addr % ws) {
+		for (i = 0; i < iovcnt; ++i) {
+			if (mirror_write(dev, addr, iov[i].base,
+					iov[i].len) < 0)
+				return (-1);
+
+			addr += iov[i].len;
+		}
+
+		return 0;
+	}
+
+	failed = 0;
+
+	for (k = 0; k < MIRROR_MEMBERS; ++k) {
+		m = dev->members[k];
+
+		if (m->writev(m->priv, addr, iov, iovcnt) < 0) {
+			mirror_setbad(dev, addr / dev->sectorsize, k);
+			failed++;
+		}
+	}
+
+	return (failed == MIRROR_MEMBERS) ? (-1) : 0;
+}
+
+static int mirror_writesector(void *d, size_t addr, const void *data,
+	size_t sz)
+{
+	return mirror_program((struct mirror_device *) d, addr, data, sz, 1);
+}
+
+// erase on the first member is left running, while it's started on
+// the second one
+static int mirror_erasesector(void *d, size_t addr)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	int k, r;
+
+	dev = (struct mirror_device *) d;
+
+	r = 0;
+
+	for (k = 0; k < MIRROR_MEMBERS; ++k) {
+		m = dev->members[k];
+
+		if (m->erasesector(m->priv, addr) < 0)
+			r = -1;
+	}
+
+	mirror_clearbad(dev, addr / dev->sectorsize,
+		addr / dev->sectorsize + 1);
+
+	return r;
+}
+
+static int mirror_eraserange(void *d, size_t addr, size_t sz)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	int k, r;
+
+	dev = (struct mirror_device *) d;
+
+	r = 0;
+
+	for (k = 0; k < MIRROR_MEMBERS; ++k) {
+		m = dev->members[k];
+
+		if (m->eraserange(m->priv, addr, sz) < 0)
+			r = -1;
+	}
+
+	mirror_clearbad(dev, addr / dev->sectorsize,
+		(addr + sz) / dev->sectorsize);
+
+	return r;
+}
+
+static int mirror_eraseall(void *d)
+{
+	struct mirror_device *dev;
+	struct bdevice *m;
+	int k, r;
+
+	dev = (struct mirror_device *) d;
+
+	r = 0;
+
+	for (k = 0; k < MIRROR_MEMBERS; ++k) {
+		m = dev->members[k];
+
+		if (m->eraseall(m->priv) < 0)
+			r = -1;
+	}
+
+	mirror_clearbad(dev, 0, SIZE_MAX);
+
+	return r;
+}
+
+static int mirror_ioctl(void *d, int req, ...)
+{
+	struct mirror_device *dev;
+	struct bdevstat st, mst;
+	struct bdevice *m;
+	va_list args;
+	size_t addr, i;
+	uint32_t *clk, mclk;
+	int k, r;
+
+	dev = (struct mirror_device *) d;
+
+	va_start(args, req);
+
+	r = 0;
+
+	switch (req) {
+	case BDEV_GETSTAT:
+		memset(&st, 0, sizeof(struct bdevstat));
+
+		// all counters are uint32_t
+		for (k = 0; k < MIRROR_MEMBERS; ++k) {
+			m = dev->members[k];
+
+			if (m->ioctl(m->priv, BDEV_GETSTAT, &mst) < 0)
+				r = -1;
+
+			for (i = 0; i < sizeof(struct bdevstat)
+					/ sizeof(uint32_t); ++i) {
+				((uint32_t *) &st)[i]
+					+= ((uint32_t *) &mst)[i];
+			}
+		}
+
+		memmove(va_arg(args, struct bdevstat *), &st,
+			sizeof(struct bdevstat));
+		break;
+
+	case BDEV_RESETSTAT:
+	case BDEV_SYNCWEAR:
+	case BDEV_UNLOCK:
+	case BDEV_LOCK:
+		for (k = 0; k < MIRROR_MEMBERS; ++k) {
+			m = dev->members[k];
+
+			if (m->ioctl(m->priv, req) < 0)
+				r = -1;
+		}
+		break;
+
+	// read has to wait only if both members are busy
+	case BDEV_BUSY:
+		r = (mirror_isbusy(dev, 0) && mirror_isbusy(dev, 1));
+		break;
+
+	// the slowest member
+	case BDEV_GETCLOCK:
+		clk = va_arg(args, uint32_t *);
+		*clk = UINT32_MAX;
+
+		for (k = 0; k < MIRROR_MEMBERS; ++k) {
+			m = dev->members[k];
+
+			if (m->ioctl(m->priv, BDEV_GETCLOCK, &mclk) < 0)
+				r = -1;
+			else
+				*clk = min(*clk, mclk);
+		}
+		break;
+
+	// filesystem doesn't always pass the address of failed data,
+	// but reports failure right after the read, so the copy of
+	// last read sector is marked bad and the retry reads another
+	// one without waiting
+	case BDEV_BADREAD:
+		m = dev->members[dev->lastmember];
+
+		r = m->ioctl(m->priv, BDEV_BADREAD,
+			dev->lastsector * dev->sectorsize);
+
+		mirror_setbad(dev, dev->lastsector, dev->lastmember);
+		break;
+
+	// both members are erased together, so counters are the same
+	case BDEV_GETERASECOUNT:
+		addr = va_arg(args, size_t);
+		m = dev->members[0];
+
+		r = m->ioctl(m->priv, BDEV_GETERASECOUNT, addr,
+			va_arg(args, uint32_t *));
+		break;
+
+	default:
+		r = -1;
+	}
+
+	va_end(args);
+
+	return r;
+}
+
+static int initdevice(void *is, struct bdevice *dev)
+{
+	struct mirror_device *md;
+	struct bdevice *m0, *m1;
+	int i;
+
+	if (devcount >= MIRROR_MAXDEVS)
+		return (-1);
+
+	md = devs + devcount;
+
+	memmove(md, is, sizeof(struct mirror_device));
+
+	m0 = md->members[0];
+	m1 = md->members[1];
+
+	if (m0 == NULL || m1 == NULL || m0->sectorsize != m1->sectorsize)
+		return (-1);
+
+	md->sectorsize = m0->sectorsize;
+
+	for (i = 0; i < MIRROR_BADSECTORS; ++i)
+		md->bad[i].member = -1;
+
+	md->badnext = 0;
+	md->lastsector = 0;
+	md->lastmember = 0;
+	md->next = 0;
+
+	sprintf(dev->name, "%s%d", "mirror", (int) devcount);
+
+	dev->priv = md;
+
+	dev->read = mirror_read;
+	dev->write = mirror_write;
+	dev->ioctl = mirror_ioctl;
+	dev->eraseall = mirror_eraseall;
+	dev->erasesector = mirror_erasesector;
+	dev->eraserange = mirror_eraserange;
+	dev->writesector = mirror_writesector;
+	dev->readv = mirror_readv;
+	dev->writev = mirror_writev;
+
+	dev->writesize = min(m0->writesize, m1->writesize);
+	dev->sectorsize = md->sectorsize;
+	dev->totalsize = min(m0->totalsize, m1->totalsize)
+		/ md->sectorsize * md->sectorsize;
+
+	dev->programtime = max(m0->programtime, m1->programtime);
+	dev->erasetime = max(m0->erasetime, m1->erasetime);
+
+	devcount++;
+
+	return 0;
+}
+
+int mirror_getdriver(struct driver *driver)
+{
+	driver->initdevice = initdevice;
+
+	return 0;
+}
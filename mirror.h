@@ -0,0 +1,41 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include "driver.h"
+
+#define MIRROR_MEMBERS 2
+#define MIRROR_MAXDEVS 1
+
+// sectors, that are remembered to have bad copy on one member
+#define MIRROR_BADSECTORS 8
+
+// sector, which copy on member failed checksum, member is -1 in
+// unused entry
+struct mirror_bad {
+	size_t sector;
+	int member;
+};
+
+// Virtual device, that keeps the same data on both members. Writes
+// go to both of them, read is served by one, that is not busy with
+// program or erase. Members must have the same sector size.
+struct mirror_device {
+	struct bdevice *members[MIRROR_MEMBERS];
+
+	size_t sectorsize;
+
+	struct mirror_bad bad[MIRROR_BADSECTORS];
+	int badnext;
+
+	// sector and member of the last read, BDEV_BADREAD refers to
+	// it; the next reads of the same sector go to the same member
+	size_t lastsector;
+	int lastmember;
+
+	// member for read, when both are idle or both are busy
+	int next;
+};
+
+int mirror_getdriver(struct driver *driver);
+
+#endif
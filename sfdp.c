@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sfdp.h"
+
+#define bits(v, hi, lo) (((v) >> (lo)) & ((1UL << ((hi) - (lo) + 1)) - 1))
+
+// Times are kept as count and unit: (count + 1) * unit.
+static uint32_t sfdp_time(uint32_t count, uint32_t unit)
+{
+	return (count + 1) * unit;
+}
+
+static uint32_t sfdp_erasetime(uint32_t v)
+{
+	const uint32_t unit[] = { 1000, 16000, 128000, 1000000 };
+
+	return sfdp_time(bits(v, 4, 0), unit[bits(v, 6, 5)]);
+}
+
+static void sfdp_parsebfpt(const uint32_t *dw, size_t n,
+	struct sfdp_info *info)
+{
+	const uint32_t ceunit[] = { 16000, 256000, 4000000, 64000000 };
+	uint32_t d;
+	int i;
+
+	memset(info, 0, sizeof(struct sfdp_info));
+
+	info->addr4 = (bits(dw[0], 18, 17) != 0);
+
+	// density in bits, as N - 1 or as power of two
+	if (dw[1] & 0x80000000) {
+		d = dw[1] & 0x7fffffff;
+		info->totalsize = (d - 3 < 32) ? 1UL << (d - 3) : 0x80000000;
+	} else
+		info->totalsize = dw[1] / 8 + 1;
+
+	if (dw[0] & (1 << 22)) {
+		info->quadread.opcode = bits(dw[2], 31, 24);
+		info->quadread.dummy = bits(dw[2], 20, 16)
+			+ bits(dw[2], 23, 21);
+	}
+
+	if (dw[0] & (1 << 16)) {
+		info->dualread.opcode = bits(dw[3], 15, 8);
+		info->dualread.dummy = bits(dw[3], 4, 0)
+			+ bits(dw[3], 7, 5);
+	}
+
+	for (i = 0; i < SFDP_ERASETYPES; ++i) {
+		d = dw[7 + i / 2] >> (16 * (i % 2));
+
+		if (bits(d, 7, 0) == 0)
+			continue;
+
+		info->erase[i].size = 1UL << bits(d, 7, 0);
+		info->erase[i].opcode = bits(d, 15, 8);
+	}
+
+	// JESD216 rev. A and later tables have times and page size
+	if (n < 11) {
+		info->pagesize = 256;
+		return;
+	}
+
+	for (i = 0; i < SFDP_ERASETYPES; ++i) {
+		if (info->erase[i].size != 0) {
+			info->erase[i].time
+				= sfdp_erasetime(bits(dw[9], 10 + 7 * i, 4 + 7 * i));
+		}
+	}
+
+	info->pagesize = 1UL << bits(dw[10], 7, 4);
+	info->programtime = sfdp_time(bits(dw[10], 12, 8),
+		(dw[10] & (1 << 13)) ? 64 : 8);
+	info->chiperasetime = sfdp_time(bits(dw[10], 28, 24),
+		ceunit[bits(dw[10], 30, 29)]);
+
+	// JESD216B, suspend is supported if bit 31 is clear
+	if (n >= 13 && (dw[11] & 0x80000000) == 0) {
+		info->suspendcmd = bits(dw[12], 31, 24);
+		info->resumecmd = bits(dw[12], 23, 16);
+	}
+}
+
+// Read SFDP header and Basic Flash Parameter Table with read
+// function, that reads SFDP address space of the device. Returns
+// 0 on success, -1 if device has no valid SFDP.
+int sfdp_parse(int (*read)(void *arg, size_t addr, void *data, size_t sz),
+	void *arg, struct sfdp_info *info)
+{
+	uint32_t hdr[2], phdr[2], dw[SFDP_BFPTMAXDWORDS];
+	size_t n, p, bfpt, bfptn;
+	int i;
+
+	if (read(arg, 0, hdr, sizeof(hdr)) < 0 || hdr[0] != SFDP_SIGNATURE)
+		return (-1);
+
+	// the first parameter header must be BFPT, but some device
+	// could have newer version of it further
+	n = bits(hdr[1], 23, 16) + 1;
+	bfpt = bfptn = 0;
+
+	for (i = 0, p = 8; i < n; ++i, p += 8) {
+		if (read(arg, p, phdr, sizeof(phdr)) < 0)
+			return (-1);
+
+		if (((bits(phdr[1], 31, 24) << 8) | bits(phdr[0], 7, 0))
+				!= SFDP_BFPTID)
+			continue;
+
+		bfpt = bits(phdr[1], 23, 0);
+		bfptn = bits(phdr[0], 31, 24);
+	}
+
+	if (bfptn < 9)
+		return (-1);
+
+	if (bfptn > SFDP_BFPTMAXDWORDS)
+		bfptn = SFDP_BFPTMAXDWORDS;
+
+	if (read(arg, bfpt, dw, bfptn * sizeof(uint32_t)) < 0)
+		return (-1);
+
+	sfdp_parsebfpt(dw, bfptn, info);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SFDP_H
+#define SFDP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// JEDEC JESD216 Serial Flash Discoverable Parameters: header at SFDP
+// address 0 points to parameter tables, the Basic Flash Parameter
+// Table (BFPT) describes density, erase types, read modes and
+// typical program and erase times.
+#define SFDP_SIGNATURE 0x50444653
+#define SFDP_BFPTID 0xff00
+#define SFDP_BFPTMAXDWORDS 16
+#define SFDP_ERASETYPES 4
+
+struct sfdp_erasetype {
+	// size in bytes, 0 if erase type is not supported
+	uint32_t size;
+	uint8_t opcode;
+
+	// typical erase time in us, 0 if table doesn't have it
+	uint32_t time;
+};
+
+struct sfdp_readmode {
+	// 0 if read mode is not supported
+	uint8_t opcode;
+
+	// wait states and mode clocks between address and data
+	uint8_t dummy;
+};
+
+struct sfdp_info {
+	uint32_t totalsize;
+	uint32_t pagesize;
+
+	// device accepts 4-byte addresses
+	int addr4;
+
+	struct sfdp_erasetype erase[SFDP_ERASETYPES];
+
+	// 1-1-2 and 1-1-4 fast reads
+	struct sfdp_readmode dualread;
+	struct sfdp_readmode quadread;
+
+	// typical page program and chip erase time in us, 0 if
+	// table doesn't have them
+	uint32_t programtime;
+	uint32_t chiperasetime;
+
+	// erase suspend and resume opcodes, 0 if not supported
+	uint8_t suspendcmd;
+	uint8_t resumecmd;
+};
+
+int sfdp_parse(int (*read)(void *arg, size_t addr, void *data, size_t sz),
+	void *arg, struct sfdp_info *info);
+
+#endif
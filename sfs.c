@@ -5,6 +5,7 @@
 #include "vfs.h"
 
 #include "sfs.h"
+#include "trace.h"
 
 #define SFS_MAXWRITESIZE 256
 #define SFS_MAXSECTORSIZE 4096
@@ -28,19 +29,26 @@
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
+// device stays writable for the whole operation, instead of
+// toggling protection around every page program and erase
+#define sfs_unlock(dev) (dev)->ioctl((dev)->priv, BDEV_UNLOCK)
+#define sfs_lock(dev) (dev)->ioctl((dev)->priv, BDEV_LOCK)
+
 const int Delay[] = {0, 10, 100, 1000, 5000};
 
+static void sfs_retrydelay(struct bdevice *dev, size_t addr, int i)
+{
+	dev->ioctl(dev->priv, BDEV_BADREAD, addr);
+
+	HAL_Delay(Delay[i]);
+}
+
 static int sfs_rewritesector(struct bdevice *dev, size_t addr,
 	const void *data, size_t sz)
 {
-	int i;
-
 	dev->erasesector(dev->priv, addr);
 
-	for (i = 0; i < sz; i += min(dev->writesize, sz - i))
-		dev->write(dev->priv, addr + i, data + i, dev->writesize);
-
-	return 0;
+	return dev->writesector(dev->priv, addr, data, sz);
 }
 
 static sfs_checksum_t sfs_checksum(const void *buf, size_t size)
@@ -55,6 +63,45 @@ static sfs_checksum_t sfs_checksum(const void *buf, size_t size)
 	return chk;
 }
 
+// checksum of the first end bytes of iovcnt pieces, without checksum
+// itself, like sfs_checksumembed() of them put together. Bytes are
+// XORed into their place in the word, where pieces split words.
+static sfs_checksum_t sfs_checksumv(const struct bdev_iovec *iov,
+	int iovcnt, size_t end)
+{
+	sfs_checksum_t chk, w;
+	const uint8_t *p;
+	size_t off, i, n;
+	int j;
+
+	// like sfs_checksum(), ignore incomplete last word
+	end -= (end - sizeof(w)) % sizeof(w);
+
+	chk = 0;
+	off = 0;
+	for (j = 0; j < iovcnt && off < end; ++j) {
+		p = iov[j].base;
+		n = min(iov[j].len, end - off);
+
+		i = (off < sizeof(w)) ? min(sizeof(w) - off, n) : 0;
+
+		for (; i < n && (off + i) % sizeof(w); ++i)
+			((uint8_t *) &chk)[(off + i) % sizeof(w)] ^= p[i];
+
+		for (; i + sizeof(w) <= n; i += sizeof(w)) {
+			memcpy(&w, p + i, sizeof(w));
+			chk ^= w;
+		}
+
+		for (; i < n; ++i)
+			((uint8_t *) &chk)[(off + i) % sizeof(w)] ^= p[i];
+
+		off += iov[j].len;
+	}
+
+	return chk;
+}
+
 static int sfs_checkdata(struct bdevice *dev, size_t addr,
 	size_t size, sfs_checksum_t cs)
 {
@@ -90,7 +137,7 @@ static int sfs_readsuperblock(struct bdevice *dev,
 		if (sb->checksum == sfs_checksumembed(sb, sz))
 			break;
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, 0, i);
 	}
 
 	return 0;
@@ -117,7 +164,7 @@ static int sfs_writesuperblock(struct bdevice *dev,
 		if (sbb.checksum == sfs_checksumembed(&sbb, sz))
 			break;
 		
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, 0, i);
 	}
 
 	return 0;
@@ -137,7 +184,7 @@ static size_t sfs_readinode(struct bdevice *dev, struct sfs_inode *in,
 		if (in->checksum == sfs_checksumembed(in, sz))
 			break;
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, n, i);
 	}
 
 	return 0;
@@ -174,37 +221,66 @@ static size_t sfs_writeinode(struct bdevice *dev,
 			break;
 		}
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, inodesector, i);
 	}
 
 	return 0;
 }
 
-static size_t sfs_readdatablock(struct bdevice *dev,
-	size_t block, void *data)
+// read data block into sectorbuf, except data bytes from off to
+// off + sz, that go directly to buf, so they don't have to be copied
+// from there; the block is still checked whole
+static size_t sfs_readdatablockv(struct bdevice *dev, size_t block,
+	void *sectorbuf, void *buf, size_t off, size_t sz)
 {
+	struct bdev_iovec iov[3];
+	struct sfs_blockmeta *meta;
 	size_t totalsize;
 	int i;
 
-	for (i = 0; i < SFS_RETRYCOUNT; ++i) {
-		sfs_checksum_t cs;
+	TRACE_ENTER(TRACE_SFSREADBLOCK, 0, block, dev->sectorsize);
+
+	meta = sfs_blockgetmeta(sectorbuf);
 
-		dev->read(dev->priv, block, data, dev->sectorsize);
+	iov[0].base = sectorbuf;
+	iov[0].len = sizeof(struct sfs_blockmeta) + off;
+	iov[1].base = buf;
+	iov[1].len = sz;
+	iov[2].base = (char *) sectorbuf + iov[0].len + sz;
+	iov[2].len = sfs_datablocksize(dev) - off - sz;
 
-		totalsize = sizeof(struct sfs_blockmeta)
-			+ sfs_blockgetmeta(data)->datasize;
+	for (i = 0; i < SFS_RETRYCOUNT; ++i) {
+		dev->readv(dev->priv, block, iov, 3);
 
-		cs = sfs_checksumembed(data, totalsize);
+		totalsize = sizeof(struct sfs_blockmeta) + meta->datasize;
 
-		if (sfs_blockgetmeta(data)->checksum == cs)
+		// size of torn block can be anything, so don't let
+		// checksum go past the buffer
+		if (totalsize <= dev->sectorsize
+				&& meta->checksum == sfs_checksumv(iov, 3,
+				totalsize))
 			break;
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, block, i);
+	}
+
+	TRACE_LEAVE(TRACE_SFSREADBLOCK, i, block, dev->sectorsize);
+
+	if (i == SFS_RETRYCOUNT) {
+		meta->datasize = min(meta->datasize, sfs_datablocksize(dev));
+
+		return FS_EBADDATABLOCK;
 	}
 
 	return 0;
 }
 
+static size_t sfs_readdatablock(struct bdevice *dev,
+	size_t block, void *data)
+{
+	return sfs_readdatablockv(dev, block, data, NULL, 0, 0);
+}
+
 static size_t sfs_writedatablock(struct bdevice *dev,
 	size_t block, void *data)
 {
@@ -216,6 +292,8 @@ static size_t sfs_writedatablock(struct bdevice *dev,
 
 	totalsize = sizeof(struct sfs_blockmeta) + meta->datasize;
 
+	TRACE_ENTER(TRACE_SFSWRITEBLOCK, 0, block, totalsize);
+
 	meta->checksum = sfs_checksumembed(data, totalsize);
 
 	for (i = 0; i < SFS_RETRYCOUNT; ++i) {
@@ -228,9 +306,11 @@ static size_t sfs_writedatablock(struct bdevice *dev,
 		if (sfs_checkdataembed(dev, block, totalsize, cs))
 			break;
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, block, i);
 	}
 
+	TRACE_LEAVE(TRACE_SFSWRITEBLOCK, i, block, totalsize);
+
 	return 0;
 }
 
@@ -303,7 +383,7 @@ static size_t sfs_inodeextent(struct bdevice *dev,
 {
 	size_t cursector, curendsector, nextsector,
 		cursz, blockcnt, block, indirectsize;
-	size_t *indirectidx;
+	sfs_size_t *indirectidx;
 	char indirectbuf[SFS_MAXSECTORSIZE];
 	struct sfs_blockmeta meta;
 	int restsz;
@@ -339,7 +419,7 @@ static size_t sfs_inodeextent(struct bdevice *dev,
 				indirectbuf);
 		}
 
-		indirectidx = (size_t *) (indirectbuf
+		indirectidx = (sfs_size_t *) (indirectbuf
 			+ sizeof(struct sfs_blockmeta));
 	}
 
@@ -352,7 +432,7 @@ static size_t sfs_inodeextent(struct bdevice *dev,
 	while (restsz > 0 && nextsector != 0) {
 		cursector = nextsector;
 	
-		if (blockcnt >= indirectsize / sizeof(size_t))
+		if (blockcnt >= indirectsize / sizeof(sfs_size_t))
 			return FS_ENODATABLOCKS;
 
 		if (blockcnt < 2)
@@ -382,7 +462,8 @@ static size_t sfs_inodeextent(struct bdevice *dev,
 
 	// update indirect addressing block
 	if (al->blockindirect != 0) {
-		sfs_blockgetmeta(indirectbuf)->datasize = blockcnt - 2;
+		sfs_blockgetmeta(indirectbuf)->datasize
+			= (blockcnt - 2) * sizeof(sfs_size_t);
 		sfs_writedatablock(dev, al->blockindirect, &indirectbuf);
 	}
 
@@ -438,13 +519,13 @@ static int sfs_writeinodeblock(struct bdevice *dev,
 
 		sfs_rewritesector(dev, inodesector, buf, dev->sectorsize);
 
-		HAL_Delay(Delay[i]);
+		sfs_retrydelay(dev, inodesector, i);
 	}
 
 	return 0;
 }
 
-size_t sfs_format(struct bdevice *dev)
+static size_t sfs_doformat(struct bdevice *dev)
 {
 	struct sfs_superblock sb;
 	struct sfs_inode buf[SFS_MAXINODEPERSECTOR];
@@ -458,7 +539,7 @@ size_t sfs_format(struct bdevice *dev)
 
 	inodespersector = dev->sectorsize / sizeof(struct sfs_inode);
 
-	dev->eraseall(dev->priv);
+	dev->eraserange(dev->priv, 0, dev->totalsize);
 	
 	sb.inodecnt = (dev->sectorsize * SFS_INODESECTORSCOUNT)
 		/ sizeof(struct sfs_inode);
@@ -519,14 +600,25 @@ size_t sfs_format(struct bdevice *dev)
 
 			sfs_rewritesector(dev, p, &meta, sz);
 
-			HAL_Delay(Delay[j]);
+			sfs_retrydelay(dev, p, j);
 		}
 	}
 
 	return 0;
 }
 
-size_t sfs_inodecreate(struct bdevice *dev, size_t sz,
+size_t sfs_format(struct bdevice *dev)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doformat(dev);
+	sfs_lock(dev);
+
+	return r;
+}
+
+static size_t sfs_doinodecreate(struct bdevice *dev, size_t sz,
 	enum FS_INODETYPE type)
 {
 	struct sfs_superblock sb;
@@ -558,7 +650,19 @@ size_t sfs_inodecreate(struct bdevice *dev, size_t sz,
 	return oldfree;
 }
 
-size_t sfs_inodedelete(struct bdevice *dev, size_t n)
+size_t sfs_inodecreate(struct bdevice *dev, size_t sz,
+	enum FS_INODETYPE type)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doinodecreate(dev, sz, type);
+	sfs_lock(dev);
+
+	return r;
+}
+
+static size_t sfs_doinodedelete(struct bdevice *dev, size_t n)
 {
 	struct sfs_superblock sb;
 	struct sfs_inode in;
@@ -587,7 +691,18 @@ size_t sfs_inodedelete(struct bdevice *dev, size_t n)
 	return 0;
 }
 
-size_t sfs_inodeset(struct bdevice *dev, size_t n,
+size_t sfs_inodedelete(struct bdevice *dev, size_t n)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doinodedelete(dev, n);
+	sfs_lock(dev);
+
+	return r;
+}
+
+static size_t sfs_doinodeset(struct bdevice *dev, size_t n,
 	const void *data, size_t sz)
 {
 	struct sfs_superblock sb;
@@ -631,6 +746,18 @@ size_t sfs_inodeset(struct bdevice *dev, size_t n,
 	return 0;
 }
 
+size_t sfs_inodeset(struct bdevice *dev, size_t n,
+	const void *data, size_t sz)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doinodeset(dev, n, data, sz);
+	sfs_lock(dev);
+
+	return r;
+}
+
 size_t sfs_inodeget(struct bdevice *dev, size_t n, void *data,
 	size_t sz)
 {
@@ -653,10 +780,12 @@ size_t sfs_inodeget(struct bdevice *dev, size_t n, void *data,
 	block = in.blocks.block[0];
 	for (p = 0; p < in.size; p += step) {
 		char sectorbuf[dev->sectorsize];
+		size_t r;
 
-		sfs_readdatablock(dev, block, sectorbuf);
-
-		memmove(data + p, sectorbuf + bsz, min(in.size - p, step));
+		r = sfs_readdatablockv(dev, block, sectorbuf, data + p, 0,
+			min(in.size - p, step));
+		if (fs_iserror(r))
+			return r;
 
 		block = sfs_blockgetmeta(sectorbuf)->next;
 	}
@@ -670,7 +799,7 @@ size_t sfs_inoderead(struct bdevice *dev, size_t n, size_t offset,
 	struct sfs_superblock sb;
 	struct sfs_inode in;
 	char indirectbuf[SFS_MAXSECTORSIZE];
-	size_t *indirectidx;
+	sfs_size_t *indirectidx;
 	size_t readsz, i;
 
 	sfs_readsuperblock(dev, &sb);
@@ -690,26 +819,40 @@ size_t sfs_inoderead(struct bdevice *dev, size_t n, size_t offset,
 		if (fs_iserror(r))
 				return r;
 	
-		indirectidx = (size_t *) (indirectbuf
+		indirectidx = (sfs_size_t *) (indirectbuf
 			+ sizeof(struct sfs_blockmeta));
 	}
 
 	readsz = min(in.size - offset, sz);
 	for (i = 0; i < readsz; ) {
 		char sectorbuf[SFS_MAXSECTORSIZE];
-		size_t blockn, b, l;
+		size_t blockn, b, l, r;
 
 		blockn = (i + offset) / sfs_datablocksize(dev);
-	
-		if (blockn < 2)
-			sfs_readdatablock(dev, in.blocks.block[blockn], sectorbuf);
-		else
-			sfs_readdatablock(dev, indirectidx[blockn - 2], sectorbuf);
-		
 		b = (i + offset) % sfs_datablocksize(dev);
-		l = min(sfs_blockgetmeta(sectorbuf)->datasize - b, readsz - i);	
-	
-		memcpy(data + i, sfs_blockgetdata(sectorbuf) + b, l);
+
+		// block is read past its data size, but bytes after it
+		// are overwritten by the next block
+		l = min(sfs_datablocksize(dev) - b, readsz - i);
+
+		if (blockn < 2) {
+			r = sfs_readdatablockv(dev, in.blocks.block[blockn],
+				sectorbuf, data + i, b, l);
+		} else if (in.blocks.blockindirect != 0
+				&& (blockn - 2) * sizeof(sfs_size_t)
+				< sfs_blockgetmeta(indirectbuf)->datasize) {
+			r = sfs_readdatablockv(dev, indirectidx[blockn - 2],
+				sectorbuf, data + i, b, l);
+		} else
+			return FS_EBADDATABLOCK;
+
+		if (fs_iserror(r))
+			return r;
+
+		if (sfs_blockgetmeta(sectorbuf)->datasize <= b)
+			return FS_EBADDATABLOCK;
+
+		l = min(sfs_blockgetmeta(sectorbuf)->datasize - b, l);
 
 		i += l;
 	}
@@ -717,13 +860,13 @@ size_t sfs_inoderead(struct bdevice *dev, size_t n, size_t offset,
 	return readsz;
 }
 
-size_t sfs_inodewrite(struct bdevice *dev, size_t n, size_t offset,
+static size_t sfs_doinodewrite(struct bdevice *dev, size_t n, size_t offset,
 	const void *data, size_t sz)
 {
 	struct sfs_superblock sb;
 	struct sfs_inode in;
 	char indirectbuf[SFS_MAXSECTORSIZE];
-	size_t *indirectidx;
+	sfs_size_t *indirectidx;
 	size_t i, r;
 
 	sfs_readsuperblock(dev, &sb);
@@ -746,7 +889,7 @@ size_t sfs_inodewrite(struct bdevice *dev, size_t n, size_t offset,
 		if (fs_iserror(r))
 				return r;
 	
-		indirectidx = (size_t *) (indirectbuf
+		indirectidx = (sfs_size_t *) (indirectbuf
 			+ sizeof(struct sfs_blockmeta));
 	}
 
@@ -781,7 +924,19 @@ size_t sfs_inodewrite(struct bdevice *dev, size_t n, size_t offset,
 	return sz;
 }
 
-size_t sfs_inodesettype(struct bdevice *dev, size_t n,
+size_t sfs_inodewrite(struct bdevice *dev, size_t n, size_t offset,
+	const void *data, size_t sz)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doinodewrite(dev, n, offset, data, sz);
+	sfs_lock(dev);
+
+	return r;
+}
+
+static size_t sfs_doinodesettype(struct bdevice *dev, size_t n,
 	enum FS_INODETYPE type)
 {
 	struct sfs_superblock sb;
@@ -798,6 +953,18 @@ size_t sfs_inodesettype(struct bdevice *dev, size_t n,
 	return 0;
 }
 
+size_t sfs_inodesettype(struct bdevice *dev, size_t n,
+	enum FS_INODETYPE type)
+{
+	size_t r;
+
+	sfs_unlock(dev);
+	r = sfs_doinodesettype(dev, n, type);
+	sfs_lock(dev);
+
+	return r;
+}
+
 size_t sfs_inodestat(struct bdevice *dev, size_t n,
 	struct fs_dirstat *st)
 {
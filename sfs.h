@@ -19,8 +19,8 @@ struct sfs_superblock {
 } __attribute__((packed));
 
 struct sfs_allocedblocks {
-	size_t block[2];
-	size_t blockindirect;
+	sfs_size_t block[2];
+	sfs_size_t blockindirect;
 } __attribute__((packed));
 
 struct sfs_inode {
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stackprof.h"
+
+// space left between painted area and the heap, so small
+// allocations during profiled call are not mistaken for stack
+#define STACKPROF_HEAPGAP 256
+
+// bytes under stackprof_begin() frame left unpainted
+#define STACKPROF_GUARD 64
+
+void *_sbrk(ptrdiff_t incr);
+
+static struct stackprof_stat Stat[STACKPROF_CALLS];
+static uint32_t *Bottom;
+static uint8_t *Top;
+static int Enabled;
+static int Nested;
+
+int stackprof_enable(int on)
+{
+	Enabled = on;
+
+	return 0;
+}
+
+void stackprof_begin()
+{
+	uint8_t *heap;
+	uint32_t *p;
+
+	if (!Enabled || Nested++ > 0)
+		return;
+
+	Top = __builtin_frame_address(0);
+
+	heap = (uint8_t *) _sbrk(0) + STACKPROF_HEAPGAP;
+
+	Bottom = (uint32_t *) ((uintptr_t) (Top - STACKPROF_DEPTH) & ~3);
+
+	if ((uint8_t *) Bottom < heap && heap < Top)
+		Bottom = (uint32_t *) ((uintptr_t) (heap + 3) & ~3);
+
+	for (p = Bottom; (uint8_t *) p < Top - STACKPROF_GUARD; ++p)
+		*p = STACKPROF_PATTERN;
+}
+
+void stackprof_end(enum STACKPROF_CALL call)
+{
+	uint8_t *heap;
+	uint32_t *p, depth;
+
+	if (!Enabled || Nested == 0 || --Nested > 0)
+		return;
+
+	// heap could grow over painted area during the call
+	heap = (uint8_t *) _sbrk(0);
+
+	p = Bottom;
+	if ((uint8_t *) p < heap && heap < Top)
+		p = (uint32_t *) ((uintptr_t) (heap + 3) & ~3);
+
+	for (; (uint8_t *) p < Top && *p == STACKPROF_PATTERN; ++p);
+
+	depth = Top - (uint8_t *) p;
+
+	Stat[call].calls++;
+
+	if (depth > Stat[call].maxdepth)
+		Stat[call].maxdepth = depth;
+
+	if (p == Bottom)
+		Stat[call].overflow = 1;
+}
+
+int stackprof_get(enum STACKPROF_CALL call, struct stackprof_stat *st)
+{
+	if (call >= STACKPROF_CALLS)
+		return (-1);
+
+	memmove(st, Stat + call, sizeof(struct stackprof_stat));
+
+	return 0;
+}
+
+int stackprof_reset()
+{
+	memset(Stat, 0, sizeof(Stat));
+
+	return 0;
+}
+
+// space between the heap and current stack pointer
+size_t stackprof_free()
+{
+	uint8_t *heap, *sp;
+
+	heap = (uint8_t *) _sbrk(0);
+	sp = __builtin_frame_address(0);
+
+	return (sp > heap) ? sp - heap : 0;
+}
+
+const char *stackprof_strcall(enum STACKPROF_CALL call)
+{
+	const char *STACKPROF_CALLNAME[] = {
+		"format", "cd", "open", "read", "write", "unlink",
+		"mkdir", "mkdev", "lsdir"
+	};
+
+	if (call >= STACKPROF_CALLS)
+		return "unknown";
+
+	return STACKPROF_CALLNAME[call];
+}
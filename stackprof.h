@@ -0,0 +1,58 @@
+#ifndef STACKPROF_H
+#define STACKPROF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// bytes of stack below caller of profiled function, that are
+// painted before the call
+#ifndef STACKPROF_DEPTH
+#define STACKPROF_DEPTH 8192
+#endif
+
+#define STACKPROF_PATTERN 0xa5a5a5a5
+
+enum STACKPROF_CALL {
+	STACKPROF_FORMAT	= 0x00,
+	STACKPROF_CD		= 0x01,
+	STACKPROF_OPEN		= 0x02,
+	STACKPROF_READ		= 0x03,
+	STACKPROF_WRITE		= 0x04,
+	STACKPROF_UNLINK	= 0x05,
+	STACKPROF_MKDIR		= 0x06,
+	STACKPROF_MKDEV		= 0x07,
+	STACKPROF_LSDIR		= 0x08,
+	STACKPROF_CALLS		= 0x09
+};
+
+struct stackprof_stat {
+	uint32_t calls;
+	uint32_t maxdepth;
+
+	// deepest use reached end of painted area, so real maximum
+	// can be bigger
+	int overflow;
+};
+
+// profiled function must have its own frame below the painted
+// start, not be merged into the caller's one
+#define STACKPROF_NOINLINE __attribute__((noinline))
+
+#define STACKPROF_BEGIN() stackprof_begin()
+#define STACKPROF_END(call) stackprof_end(call)
+
+int stackprof_enable(int on);
+
+void stackprof_begin();
+
+void stackprof_end(enum STACKPROF_CALL call);
+
+int stackprof_get(enum STACKPROF_CALL call, struct stackprof_stat *st);
+
+int stackprof_reset();
+
+size_t stackprof_free();
+
+const char *stackprof_strcall(enum STACKPROF_CALL call);
+
+#endif
@@ -2,6 +2,8 @@
 
 extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim2;
+extern DMA_HandleTypeDef hdma_spi1_rx;
+extern DMA_HandleTypeDef hdma_spi1_tx;
 
 void HAL_MspInit(void)
 {
@@ -23,6 +25,41 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
 		GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
 		GPIO_InitStruct.Alternate = GPIO_AF5_SPI1;
 		HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+		hdma_spi1_rx.Instance = DMA2_Stream0;
+		hdma_spi1_rx.Init.Channel = DMA_CHANNEL_3;
+		hdma_spi1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+		hdma_spi1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+		hdma_spi1_rx.Init.MemInc = DMA_MINC_ENABLE;
+		hdma_spi1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+		hdma_spi1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+		hdma_spi1_rx.Init.Mode = DMA_NORMAL;
+		hdma_spi1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+		hdma_spi1_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+		if (HAL_DMA_Init(&hdma_spi1_rx) != HAL_OK)
+			error_handler();
+
+		__HAL_LINKDMA(hspi, hdmarx, hdma_spi1_rx);
+
+		hdma_spi1_tx.Instance = DMA2_Stream3;
+		hdma_spi1_tx.Init.Channel = DMA_CHANNEL_3;
+		hdma_spi1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+		hdma_spi1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+		hdma_spi1_tx.Init.MemInc = DMA_MINC_ENABLE;
+		hdma_spi1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+		hdma_spi1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+		hdma_spi1_tx.Init.Mode = DMA_NORMAL;
+		hdma_spi1_tx.Init.Priority = DMA_PRIORITY_HIGH;
+		hdma_spi1_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+		if (HAL_DMA_Init(&hdma_spi1_tx) != HAL_OK)
+			error_handler();
+
+		__HAL_LINKDMA(hspi, hdmatx, hdma_spi1_tx);
+
+		HAL_NVIC_SetPriority(SPI1_IRQn, 0, 0);
+		HAL_NVIC_EnableIRQ(SPI1_IRQn);
 	}
 }
 
@@ -31,6 +68,10 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* hspi)
 	if (hspi->Instance == SPI1) {
 		__HAL_RCC_SPI1_CLK_DISABLE();
 		HAL_GPIO_DeInit(GPIOA, GPIO_PIN_5|GPIO_PIN_6|GPIO_PIN_7);
+
+		HAL_DMA_DeInit(hspi->hdmarx);
+		HAL_DMA_DeInit(hspi->hdmatx);
+		HAL_NVIC_DisableIRQ(SPI1_IRQn);
 	}
 }
 
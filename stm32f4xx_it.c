@@ -1,9 +1,13 @@
 #include "main.h"
 #include "stm32f4xx_it.h"
+#include "w25.h"
 
 extern DMA_HandleTypeDef hdma_adc1;
 extern TIM_HandleTypeDef htim2;
 extern UART_HandleTypeDef huart1;
+extern SPI_HandleTypeDef hspi1;
+extern DMA_HandleTypeDef hdma_spi1_rx;
+extern DMA_HandleTypeDef hdma_spi1_tx;
 
 void NMI_Handler(void)
 {
@@ -45,6 +49,8 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
 	HAL_IncTick();
+
+	w25_poll();
 }
 
 void TIM2_IRQHandler(void)
@@ -56,3 +62,18 @@ void USART1_IRQHandler(void)
 {
 	HAL_UART_IRQHandler(&huart1);
 }
+
+void SPI1_IRQHandler(void)
+{
+	HAL_SPI_IRQHandler(&hspi1);
+}
+
+void DMA2_Stream0_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_spi1_rx);
+}
+
+void DMA2_Stream3_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_spi1_tx);
+}
@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "stripe.h"
+
+static struct stripe_device devs[STRIPE_MAXDEVS];
+static size_t devcount = 0;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// member, that holds address addr, and address on it
+static struct bdevice *stripe_map(struct stripe_device *dev, size_t addr,
+	size_t *maddr)
+{
+	size_t s;
+
+	s = addr / dev->sectorsize;
+
+	*maddr = s / dev->count * dev->sectorsize + addr % dev->sectorsize;
+
+	return dev->members[s % dev->count];
+}
+
+// bytes from addr to the end of its sector, but not more than sz
+static size_t stripe_piece(struct stripe_device *dev, size_t addr,
+	size_t sz)
+{
+	return min(sz, dev->sectorsize - addr % dev->sectorsize);
+}
+
+static int stripe_read(void *d, size_t addr, void *data, size_t sz)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr, i, n;
+	int r;
+
+	dev = (struct stripe_device *) d;
+
+	for (i = 0; i < sz; i += n) {
+		n = stripe_piece(dev, addr + i, sz - i);
+		m = stripe_map(dev, addr + i, &maddr);
+
+		if ((r = m->read(m->priv, maddr, data + i, n)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int stripe_write(void *d, size_t addr, const void *data, size_t sz)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr, i, n;
+	int r;
+
+	dev = (struct stripe_device *) d;
+
+	for (i = 0; i < sz; i += n) {
+		n = stripe_piece(dev, addr + i, sz - i);
+		m = stripe_map(dev, addr + i, &maddr);
+
+		if ((r = m->write(m->priv, maddr, data + i, n)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+// total size of iovcnt pieces
+static size_t stripe_iovsize(const struct bdev_iovec *iov, int iovcnt)
+{
+	size_t sz;
+	int i;
+
+	sz = 0;
+	for (i = 0; i < iovcnt; ++i)
+		sz += iov[i].len;
+
+	return sz;
+}
+
+// pieces within one sector are on one member and go to it in one
+// transfer, otherwise they are read one by one
+static int stripe_readv(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr, sz;
+	int i, r;
+
+	dev = (struct stripe_device *) d;
+
+	sz = stripe_iovsize(iov, iovcnt);
+
+	if (stripe_piece(dev, addr, sz) == sz) {
+		m = stripe_map(dev, addr, &maddr);
+
+		return m->readv(m->priv, maddr, iov, iovcnt);
+	}
+
+	for (i = 0; i < iovcnt; ++i) {
+		if ((r = stripe_read(dev, addr, iov[i].base, iov[i].len)) < 0)
+			return r;
+
+		addr += iov[i].len;
+	}
+
+	return 0;
+}
+
+static int stripe_writev(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr, sz;
+	int i, r;
+
+	dev = (struct stripe_device *) d;
+
+	sz = stripe_iovsize(iov, iovcnt);
+
+	if (stripe_piece(dev, addr, sz) == sz) {
+		m = stripe_map(dev, addr, &maddr);
+
+		return m->writev(m->priv, maddr, iov, iovcnt);
+	}
+
+	for (i = 0; i < iovcnt; ++i) {
+		if ((r = stripe_write(dev, addr, iov[i].base,
+				iov[i].len)) < 0)
+			return r;
+
+		addr += iov[i].len;
+	}
+
+	return 0;
+}
+
+static int stripe_writesector(void *d, size_t addr, const void *data,
+	size_t sz)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr, i, n;
+	int r;
+
+	dev = (struct stripe_device *) d;
+
+	for (i = 0; i < sz; i += n) {
+		n = stripe_piece(dev, addr + i, sz - i);
+		m = stripe_map(dev, addr + i, &maddr);
+
+		if ((r = m->writesector(m->priv, maddr, data + i, n)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int stripe_erasesector(void *d, size_t addr)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t maddr;
+
+	dev = (struct stripe_device *) d;
+
+	m = stripe_map(dev, addr, &maddr);
+
+	return m->erasesector(m->priv, maddr);
+}
+
+// part of range on every member is contiguous, parts are erased in
+// STRIPE_ERASECHUNK pieces on members in turn, so while one member
+// erases its piece, erase of the next one is already started
+static int stripe_eraserange(void *d, size_t addr, size_t sz)
+{
+	struct stripe_device *dev;
+	struct bdevice *m;
+	size_t start[STRIPE_MAXMEMBERS], end[STRIPE_MAXMEMBERS];
+	size_t s0, s1, n;
+	int i, left, r;
+
+	dev = (struct stripe_device *) d;
+
+	if (addr % dev->sectorsize || sz % dev->sectorsize
+			|| addr + sz > dev->membersize * dev->count)
+		return (-1);
+
+	s0 = addr / dev->sectorsize;
+	s1 = (addr + sz) / dev->sectorsize;
+
+	for (i = 0; i < dev->count; ++i) {
+		start[i] = (s0 + dev->count - 1 - i) / dev->count
+			* dev->sectorsize;
+		end[i] = (s1 + dev->count - 1 - i) / dev->count
+			* dev->sectorsize;
+	}
+
+	do {
+		left = 0;
+
+		for (i = 0; i < dev->count; ++i) {
+			if (start[i] >= end[i])
+				continue;
+
+			m = dev->members[i];
+			n = min(end[i] - start[i], STRIPE_ERASECHUNK
+				- start[i] % STRIPE_ERASECHUNK);
+
+			if ((r = m->eraserange(m->priv, start[i], n)) < 0)
+				return r;
+
+			start[i] += n;
+			left = 1;
+		}
+	} while (left);
+
+	return 0;
+}
+
+static int stripe_eraseall(void *d)
+{
+	struct stripe_device *dev;
+
+	dev = (struct stripe_device *) d;
+
+	return stripe_eraserange(dev, 0, dev->membersize * dev->count);
+}
+
+static int stripe_ioctl(void *d, int req, ...)
+{
+	struct stripe_device *dev;
+	struct bdevstat st, mst;
+	struct bdevice *m;
+	va_list args;
+	size_t addr, maddr, i;
+	uint32_t *clk, mclk;
+	int j, r;
+
+	dev = (struct stripe_device *) d;
+
+	va_start(args, req);
+
+	r = 0;
+
+	switch (req) {
+	case BDEV_GETSTAT:
+		memset(&st, 0, sizeof(struct bdevstat));
+
+		// all counters are uint32_t
+		for (j = 0; j < dev->count; ++j) {
+			m = dev->members[j];
+
+			if (m->ioctl(m->priv, BDEV_GETSTAT, &mst) < 0)
+				r = -1;
+
+			for (i = 0; i < sizeof(struct bdevstat)
+					/ sizeof(uint32_t); ++i) {
+				((uint32_t *) &st)[i]
+					+= ((uint32_t *) &mst)[i];
+			}
+		}
+
+		memmove(va_arg(args, struct bdevstat *), &st,
+			sizeof(struct bdevstat));
+		break;
+
+	case BDEV_RESETSTAT:
+	case BDEV_SYNCWEAR:
+	case BDEV_UNLOCK:
+	case BDEV_LOCK:
+		for (j = 0; j < dev->count; ++j) {
+			m = dev->members[j];
+
+			if (m->ioctl(m->priv, req) < 0)
+				r = -1;
+		}
+		break;
+
+	// busy if any member is
+	case BDEV_BUSY:
+		for (j = 0; j < dev->count; ++j) {
+			m = dev->members[j];
+
+			if (m->ioctl(m->priv, BDEV_BUSY) > 0)
+				r = 1;
+		}
+		break;
+
+	// the slowest member
+	case BDEV_GETCLOCK:
+		clk = va_arg(args, uint32_t *);
+		*clk = UINT32_MAX;
+
+		for (j = 0; j < dev->count; ++j) {
+			m = dev->members[j];
+
+			if (m->ioctl(m->priv, BDEV_GETCLOCK, &mclk) < 0)
+				r = -1;
+			else
+				*clk = min(*clk, mclk);
+		}
+		break;
+
+	case BDEV_BADREAD:
+		addr = va_arg(args, size_t);
+		m = stripe_map(dev, addr, &maddr);
+
+		r = m->ioctl(m->priv, BDEV_BADREAD, maddr);
+		break;
+
+	case BDEV_GETERASECOUNT:
+		addr = va_arg(args, size_t);
+		m = stripe_map(dev, addr, &maddr);
+
+		r = m->ioctl(m->priv, BDEV_GETERASECOUNT, maddr,
+			va_arg(args, uint32_t *));
+		break;
+
+	default:
+		r = -1;
+	}
+
+	va_end(args);
+
+	return r;
+}
+
+static int initdevice(void *is, struct bdevice *dev)
+{
+	struct stripe_device *sd;
+	struct bdevice *m;
+	int i;
+
+	if (devcount >= STRIPE_MAXDEVS)
+		return (-1);
+
+	sd = devs + devcount;
+
+	memmove(sd, is, sizeof(struct stripe_device));
+
+	if (sd->count < 1 || sd->count > STRIPE_MAXMEMBERS)
+		return (-1);
+
+	sd->sectorsize = sd->members[0]->sectorsize;
+	sd->membersize = sd->members[0]->totalsize;
+
+	dev->writesize = sd->members[0]->writesize;
+	dev->programtime = dev->erasetime = 0;
+
+	for (i = 0; i < sd->count; ++i) {
+		m = sd->members[i];
+
+		if (m->sectorsize != sd->sectorsize)
+			return (-1);
+
+		sd->membersize = min(sd->membersize, m->totalsize);
+
+		dev->writesize = min(dev->writesize, m->writesize);
+		dev->programtime = max(dev->programtime, m->programtime);
+		dev->erasetime = max(dev->erasetime, m->erasetime);
+	}
+
+	sd->membersize = sd->membersize / sd->sectorsize * sd->sectorsize;
+
+	sprintf(dev->name, "%s%d", "stripe", (int) devcount);
+
+	dev->priv = sd;
+
+	dev->read = stripe_read;
+	dev->write = stripe_write;
+	dev->ioctl = stripe_ioctl;
+	dev->eraseall = stripe_eraseall;
+	dev->erasesector = stripe_erasesector;
+	dev->eraserange = stripe_eraserange;
+	dev->writesector = stripe_writesector;
+	dev->readv = stripe_readv;
+	dev->writev = stripe_writev;
+
+	dev->sectorsize = sd->sectorsize;
+	dev->totalsize = sd->membersize * sd->count;
+
+	devcount++;
+
+	return 0;
+}
+
+int stripe_getdriver(struct driver *driver)
+{
+	driver->initdevice = initdevice;
+
+	return 0;
+}
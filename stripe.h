@@ -0,0 +1,26 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include "driver.h"
+
+#define STRIPE_MAXMEMBERS 4
+#define STRIPE_MAXDEVS 2
+
+// erase range is split into pieces of that size on every member,
+// that are erased in turn
+#define STRIPE_ERASECHUNK (4096 * 16)
+
+// Virtual device, that puts its sectors on members in turn: sector n
+// is sector n / count of member n % count. Members must have the
+// same sector size.
+struct stripe_device {
+	struct bdevice *members[STRIPE_MAXMEMBERS];
+	int count;
+
+	size_t sectorsize;
+	size_t membersize;
+};
+
+int stripe_getdriver(struct driver *driver);
+
+#endif
@@ -0,0 +1,88 @@
+#include "stm32f4xx_hal.h"
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+static struct trace_record Ring[TRACE_RINGSIZE];
+static size_t Ringstart;
+static size_t Ringcount;
+static int Enabled;
+
+int trace_init()
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	Enabled = 0;
+
+	return trace_clear();
+}
+
+int trace_enable(int on)
+{
+	Enabled = on;
+
+	return 0;
+}
+
+void trace_event(uint8_t event, uint32_t n, uint32_t addr, uint32_t size)
+{
+	struct trace_record *r;
+
+	if (!Enabled)
+		return;
+
+	// when ring is full, oldest record is overwritten
+	if (Ringcount < TRACE_RINGSIZE)
+		r = Ring + (Ringstart + Ringcount++) % TRACE_RINGSIZE;
+	else {
+		r = Ring + Ringstart;
+		Ringstart = (Ringstart + 1) % TRACE_RINGSIZE;
+	}
+
+	r->time = DWT->CYCCNT;
+	r->event = ((uint32_t) event << 24) | (n & 0xffffff);
+	r->addr = addr;
+	r->size = size;
+}
+
+size_t trace_count()
+{
+	return Ringcount;
+}
+
+int trace_get(size_t i, struct trace_record *r)
+{
+	if (i >= Ringcount)
+		return (-1);
+
+	memmove(r, Ring + (Ringstart + i) % TRACE_RINGSIZE,
+		sizeof(struct trace_record));
+
+	return 0;
+}
+
+int trace_clear()
+{
+	Ringstart = Ringcount = 0;
+
+	return 0;
+}
+
+const char *trace_strevent(uint8_t event)
+{
+	const char *TRACE_EVENTNAME[] = {
+		"unknown", "open", "read", "write", "dirlookup",
+		"sfs_readdatablock", "sfs_writedatablock",
+		"w25_read", "w25_write", "w25_erasesector",
+		"w25_eraserange"
+	};
+
+	event &= ~TRACE_EXIT;
+
+	if (event > TRACE_W25ERASERANGE)
+		event = 0;
+
+	return TRACE_EVENTNAME[event];
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef TRACE_RINGSIZE
+#define TRACE_RINGSIZE 128
+#endif
+
+#define TRACE_EXIT 0x80
+
+enum TRACE_EVENT {
+	TRACE_OPEN		= 0x01,
+	TRACE_READ		= 0x02,
+	TRACE_WRITE		= 0x03,
+	TRACE_DIRLOOKUP		= 0x04,
+	TRACE_SFSREADBLOCK	= 0x05,
+	TRACE_SFSWRITEBLOCK	= 0x06,
+	TRACE_W25READ		= 0x07,
+	TRACE_W25WRITE		= 0x08,
+	TRACE_W25ERASESECTOR	= 0x09,
+	TRACE_W25ERASERANGE	= 0x0a
+};
+
+// Event id (with TRACE_EXIT flag for exit records) is kept in the
+// highest byte of the second word, fd, inode or device number in the
+// rest of it. Time is a value of DWT cycle counter.
+struct trace_record {
+	uint32_t time;
+	uint32_t event;
+	uint32_t addr;
+	uint32_t size;
+};
+
+#define trace_recordevent(r) ((r)->event >> 24)
+#define trace_recordn(r) ((r)->event & 0xffffff)
+
+#define TRACE_ENTER(ev, n, addr, sz) trace_event((ev), (n), (addr), (sz))
+#define TRACE_LEAVE(ev, n, addr, sz) \
+	trace_event((ev) | TRACE_EXIT, (n), (addr), (sz))
+
+int trace_init();
+
+int trace_enable(int on);
+
+void trace_event(uint8_t event, uint32_t n, uint32_t addr, uint32_t size);
+
+size_t trace_count();
+
+int trace_get(size_t i, struct trace_record *r);
+
+int trace_clear();
+
+const char *trace_strevent(uint8_t event);
+
+#endif
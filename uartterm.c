@@ -22,6 +22,9 @@ static char *Toks[MAXTOKS];
 
 static UART_HandleTypeDef *huart;
 
+// called while waiting for the next character
+static void (*Idle)();
+
 static struct ut_command Commtable[32];
 static size_t Commcount;
 
@@ -66,7 +69,10 @@ int ut_getcommand()
 	if (HAL_UART_Receive_IT(huart, Rxdata + Rxoffset, 1)
 		!= HAL_BUSY) {
 
-		while (HAL_UART_GetState(huart) == HAL_UART_STATE_BUSY_RX);
+		while (HAL_UART_GetState(huart) == HAL_UART_STATE_BUSY_RX) {
+			if (Idle != NULL)
+				Idle();
+		}
 
 		if (Rxoffset >= RXBUFSZ - 1 || Rxdata[Rxoffset] == '\r') {
 			uint8_t s[2] = {'\r', '\n'};
@@ -134,6 +140,14 @@ int ut_init(UART_HandleTypeDef *hu)
 	huart = hu;
 
 	Commcount = 0;
+	Idle = NULL;
+
+	return 0;
+}
+
+int ut_setidle(void (*idle)())
+{
+	Idle = idle;
 
 	return 0;
 }
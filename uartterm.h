@@ -11,6 +11,8 @@ int ut_write(const char *format, ...);
 
 int ut_init(UART_HandleTypeDef *hu);
 
+int ut_setidle(void (*idle)());
+
 int ut_addcommand(const char *name, int (*func)(const char **));
 
 int ut_executecommand();
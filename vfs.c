@@ -1,5 +1,7 @@
 #include "vfs.h"
 #include "calls.h"
+#include "trace.h"
+#include "stackprof.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -205,7 +207,7 @@ static size_t dirsearch(void *buf, const char *name)
 	return FS_ENAMENOTFOUND;
 }
 
-static size_t dirlookup(const char **toks, struct lookupres *lr,
+static size_t dirwalk(const char **toks, struct lookupres *lr,
 	int flags)
 {
 	const char *curpath[PATHMAXTOK];
@@ -270,6 +272,20 @@ static size_t dirlookup(const char **toks, struct lookupres *lr,
 	return 0;
 }
 
+static size_t dirlookup(const char **toks, struct lookupres *lr,
+	int flags)
+{
+	size_t r;
+
+	TRACE_ENTER(TRACE_DIRLOOKUP, 0, 0, 0);
+
+	r = dirwalk(toks, lr, flags);
+
+	TRACE_LEAVE(TRACE_DIRLOOKUP, (r == 0) ? lr->inode.addr : 0, 0, r);
+
+	return r;
+}
+
 static size_t dirfindinode(void *buf, size_t n)
 {
 	size_t offset;
@@ -368,6 +384,7 @@ static size_t dirdeleteinode(struct inode *in, size_t n)
 	return 0;
 }
 
+STACKPROF_NOINLINE
 static int mkfile(const char *path, enum FS_INODETYPE type)
 {
 	const char *toks[PATHMAXTOK];
@@ -520,7 +537,8 @@ int mountlist(const char **list, char *buf, size_t bufsz)
 	return 0;
 }
 
-int format(const char *target)
+STACKPROF_NOINLINE
+static int fsformat(const char *target)
 {
 	int mountid;
 	struct vfsmount *mnt;
@@ -543,7 +561,21 @@ int format(const char *target)
 	return makeroot(mnt->dev, mnt->fs);
 }
 
-int cd(const char *path)
+int format(const char *target)
+{
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = fsformat(target);
+
+	STACKPROF_END(STACKPROF_FORMAT);
+
+	return r;
+}
+
+STACKPROF_NOINLINE
+static int dirchange(const char *path)
 {
 	const char *toks[PATHMAXTOK];
 	char pathbuf[PATHMAX];
@@ -586,7 +618,21 @@ int cd(const char *path)
 	return 0;
 }
 
-int open(const char *path, int flags)
+int cd(const char *path)
+{
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = dirchange(path);
+
+	STACKPROF_END(STACKPROF_CD);
+
+	return r;
+}
+
+STACKPROF_NOINLINE
+static int fileopen(const char *path, int flags)
 {
 	const char *toks[PATHMAXTOK];
 	char pathbuf[PATHMAX];
@@ -627,6 +673,21 @@ int open(const char *path, int flags)
 	return fd;
 }
 
+int open(const char *path, int flags)
+{
+	int fd;
+
+	STACKPROF_BEGIN();
+	TRACE_ENTER(TRACE_OPEN, 0, flags, 0);
+
+	fd = fileopen(path, flags);
+
+	TRACE_LEAVE(TRACE_OPEN, fd, flags, 0);
+	STACKPROF_END(STACKPROF_OPEN);
+
+	return fd;
+}
+
 int close(int fd)
 {
 	if (!isinset(fileset, fd))
@@ -639,7 +700,8 @@ int close(int fd)
 	return 0;
 }
 
-int write(int fd, const void *buf, size_t count)
+STACKPROF_NOINLINE
+static int filewrite(int fd, const void *buf, size_t count)
 {
 	struct vfsmount *mnt;
 	size_t n, r;
@@ -663,7 +725,26 @@ int write(int fd, const void *buf, size_t count)
 	return 0;
 }
 
-int read(int fd, void *buf, size_t count)
+int write(int fd, const void *buf, size_t count)
+{
+	size_t offset;
+	int r;
+
+	offset = isinset(fileset, fd) ? files[fd]->offset : 0;
+
+	STACKPROF_BEGIN();
+	TRACE_ENTER(TRACE_WRITE, fd, offset, count);
+
+	r = filewrite(fd, buf, count);
+
+	TRACE_LEAVE(TRACE_WRITE, fd, offset, r);
+	STACKPROF_END(STACKPROF_WRITE);
+
+	return r;
+}
+
+STACKPROF_NOINLINE
+static int fileread(int fd, void *buf, size_t count)
 {
 	struct vfsmount *mnt;
 	size_t r;
@@ -683,6 +764,24 @@ int read(int fd, void *buf, size_t count)
 	return r;
 }
 
+int read(int fd, void *buf, size_t count)
+{
+	size_t offset;
+	int r;
+
+	offset = isinset(fileset, fd) ? files[fd]->offset : 0;
+
+	STACKPROF_BEGIN();
+	TRACE_ENTER(TRACE_READ, fd, offset, count);
+
+	r = fileread(fd, buf, count);
+
+	TRACE_LEAVE(TRACE_READ, fd, offset, r);
+	STACKPROF_END(STACKPROF_READ);
+
+	return r;
+}
+
 int ioctl(int fd, int req, ...)
 {
 	if (!isinset(fileset, fd))
@@ -727,7 +826,8 @@ static int dirisempty(struct inode *in)
 	return ((nn != 0xffffffff) ? EDIRNOTEMPTY : 0);
 }
 
-int unlink(const char *path)
+STACKPROF_NOINLINE
+static int fileunlink(const char *path)
 {
 	const char *toks[PATHMAXTOK];
 	char pathbuf[PATHMAX];
@@ -774,12 +874,35 @@ int unlink(const char *path)
 	return 0;
 }
 
+int unlink(const char *path)
+{
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = fileunlink(path);
+
+	STACKPROF_END(STACKPROF_UNLINK);
+
+	return r;
+}
+
 int mkdir(const char *path)
 {
-	return mkfile(path, FS_DIR);
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = mkfile(path, FS_DIR);
+
+	STACKPROF_END(STACKPROF_MKDIR);
+
+	return r;
 }
 
-int mkdev(const char *path, size_t driverid, size_t deviceid)
+STACKPROF_NOINLINE
+static int devcreate(const char *path, size_t driverid,
+	size_t deviceid)
 {
 	const char *toks[PATHMAXTOK];
 	char pathbuf[PATHMAX];
@@ -815,7 +938,22 @@ int mkdev(const char *path, size_t driverid, size_t deviceid)
 	return 0;
 }
 
-int lsdir(const char *path, const char **list, char *buf, size_t bufsz)
+int mkdev(const char *path, size_t driverid, size_t deviceid)
+{
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = devcreate(path, driverid, deviceid);
+
+	STACKPROF_END(STACKPROF_MKDEV);
+
+	return r;
+}
+
+STACKPROF_NOINLINE
+static int dirlist(const char *path, const char **list, char *buf,
+	size_t bufsz)
 {
 	const char *toks[PATHMAXTOK];
 	char dirbuf[DIRMAX], *bufp;
@@ -869,6 +1007,19 @@ int lsdir(const char *path, const char **list, char *buf, size_t bufsz)
 	return 0;
 }
 
+int lsdir(const char *path, const char **list, char *buf, size_t bufsz)
+{
+	int r;
+
+	STACKPROF_BEGIN();
+
+	r = dirlist(path, list, buf, bufsz);
+
+	STACKPROF_END(STACKPROF_LSDIR);
+
+	return r;
+}
+
 const char *vfs_strerror(enum ERROR e)
 {
 	char *strerror[] = {
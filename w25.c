@@ -2,234 +2,1589 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 #include "w25.h"
+#include "trace.h"
 
 static struct w25_device devs[W25_MAXDEVS];
 size_t devcount = 0;
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// transfers shorter than W25_DMAMIN are done by polling, DMA setup
+// takes longer than they do; DMA transfer length is 16-bit
+#define W25_DMAMIN 32
+#define W25_DMAMAX 0xffff
+#define W25_DMATIMEOUT 5000
+
+// with W25_LLSPI 1 commands, status polls and polled transfers use
+// SPI and GPIO registers directly: HAL lock, state and timeout
+// handling take longer than a few bytes on the bus. DMA transfers
+// still go through HAL.
+#ifndef W25_LLSPI
+#define W25_LLSPI 0
+#endif
+
+// program and erase completion is polled first after typical time of
+// the operation, then every W25_POLLDIV-th of it, but not more often
+// than every W25_POLLMIN us
+#define W25_POLLDIV 8
+#define W25_POLLMIN 20
+
+// status read from SysTick interrupt gives up after W25_IRQTIMEOUT us
+#define W25_IRQTIMEOUT 100
+
+static void w25_dmadone(SPI_HandleTypeDef *hspi)
+{
+	int i;
+
+	for (i = 0; i < devcount; ++i) {
+		if (devs[i].hspi == hspi)
+			devs[i].dmabusy = 0;
+	}
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25_dmadone(hspi);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25_dmadone(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25_dmadone(hspi);
+}
+
+static int w25_dmawait(struct w25_device *dev)
+{
+	uint32_t start;
+
+	start = HAL_GetTick();
+
+	while (dev->dmabusy) {
+		if (HAL_GetTick() - start > W25_DMATIMEOUT) {
+			HAL_SPI_Abort(dev->hspi);
+			dev->dmabusy = 0;
+
+			return (-1);
+		}
+	}
+
+	return (dev->hspi->ErrorCode == HAL_SPI_ERROR_NONE) ? 0 : (-1);
+}
+
+static void w25_select(struct w25_device *dev)
+{
+#if W25_LLSPI
+	dev->gpio->BSRR = (uint32_t) dev->pin << 16;
+#else
+	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
+#endif
+}
+
+static void w25_deselect(struct w25_device *dev)
+{
+#if W25_LLSPI
+	dev->gpio->BSRR = dev->pin;
+#else
+	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+#endif
+}
+
+// SPI is enabled by the first HAL transfer, and it may be not done yet
+static SPI_TypeDef *w25_spi(struct w25_device *dev)
+{
+	if ((dev->hspi->Instance->CR1 & SPI_CR1_SPE) == 0)
+		__HAL_SPI_ENABLE(dev->hspi);
+
+	return dev->hspi->Instance;
+}
+
+// send sz bytes by polling, bytes received meanwhile are dropped.
+// Returns when the last one is out of shift register, so chip can be
+// deselected.
+static int w25_spitx(struct w25_device *dev, const uint8_t *data,
+	size_t sz)
+{
+#if W25_LLSPI
+	SPI_TypeDef *spi;
+	size_t i;
+
+	spi = w25_spi(dev);
+
+	for (i = 0; i < sz; ++i) {
+		while ((spi->SR & SPI_SR_TXE) == 0);
+		*((volatile uint8_t *) &spi->DR) = data[i];
+	}
+
+	while ((spi->SR & SPI_SR_TXE) == 0);
+	while (spi->SR & SPI_SR_BSY);
+
+	// clear overrun, reading DR then SR
+	(void) spi->DR;
+	(void) spi->SR;
+
+	return 0;
+#else
+	return (HAL_SPI_Transmit(dev->hspi, (uint8_t *) data, sz, 5000)
+		== HAL_OK) ? 0 : (-1);
+#endif
+}
+
+// receive sz bytes by polling, sending 0xff
+static int w25_spirx(struct w25_device *dev, uint8_t *data, size_t sz)
+{
+#if W25_LLSPI
+	SPI_TypeDef *spi;
+	size_t i;
+
+	spi = w25_spi(dev);
+
+	for (i = 0; i < sz; ++i) {
+		while ((spi->SR & SPI_SR_TXE) == 0);
+		*((volatile uint8_t *) &spi->DR) = 0xff;
+
+		while ((spi->SR & SPI_SR_RXNE) == 0);
+		data[i] = *((volatile uint8_t *) &spi->DR);
+	}
+
+	while (spi->SR & SPI_SR_BSY);
+
+	return 0;
+#else
+	return (HAL_SPI_Receive(dev->hspi, data, sz, 5000)
+		== HAL_OK) ? 0 : (-1);
+#endif
+}
+
+// receive sz bytes with DMA, if SPI has DMA stream linked, or by
+// polling otherwise; with chip selected by caller
+static int w25_receive(struct w25_device *dev, uint8_t *data, size_t sz)
+{
+	size_t n;
+
+	for (; sz > 0; data += n, sz -= n) {
+		n = min(sz, W25_DMAMAX);
+
+		if (dev->hspi->hdmarx == NULL || n < W25_DMAMIN) {
+			if (w25_spirx(dev, data, n) < 0)
+				return (-1);
+
+			continue;
+		}
+
+		dev->dmabusy = 1;
+
+		if (HAL_SPI_Receive_DMA(dev->hspi, data, n) != HAL_OK) {
+			dev->dmabusy = 0;
+			return (-1);
+		}
+
+		if (w25_dmawait(dev) < 0)
+			return (-1);
+
+		dev->stat.dmatransfers++;
+	}
+
+	return 0;
+}
+
+static int w25_transmit(struct w25_device *dev, const uint8_t *data,
+	size_t sz)
+{
+	size_t n;
+
+	for (; sz > 0; data += n, sz -= n) {
+		n = min(sz, W25_DMAMAX);
+
+		if (dev->hspi->hdmatx == NULL || n < W25_DMAMIN) {
+			if (w25_spitx(dev, data, n) < 0)
+				return (-1);
+
+			continue;
+		}
+
+		dev->dmabusy = 1;
+
+		if (HAL_SPI_Transmit_DMA(dev->hspi, (uint8_t *) data, n)
+				!= HAL_OK) {
+			dev->dmabusy = 0;
+			return (-1);
+		}
+
+		if (w25_dmawait(dev) < 0)
+			return (-1);
+
+		dev->stat.dmatransfers++;
+	}
+
+	return 0;
+}
+
+static int w25_getid(struct w25_device *dev)
+{
+	uint8_t sbuf[4], rbuf[4];
+
+	sbuf[0] = 0x9f;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_spirx(dev, rbuf, 3);
+	w25_deselect(dev);
+
+	return ((rbuf[0] << 16) | (rbuf[1] << 8) | rbuf[2]);
+}
+
+static int w25_init(struct w25_device *dev)
+{
+	uint8_t sbuf[4], rbuf[4];
+
+	// cycle counter is used to measure busy time
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	HAL_Delay(100);
+
+	sbuf[0] = 0x66;
+	sbuf[1] = 0x99;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 2);
+	w25_deselect(dev);
+
+	HAL_Delay(100);
+
+	// chip strapped to power up in 4-byte address mode (ADS bit of
+	// status register 3) is switched to 3-byte mode with 0xE9, so
+	// 0x03, 0x02 and 0x20 take 3-byte address like on the others;
+	// 4-byte address commands take 4 bytes in both modes
+	sbuf[0] = 0x15;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_spirx(dev, rbuf, 1);
+	w25_deselect(dev);
+
+	if (rbuf[0] & 0x01) {
+		sbuf[0] = 0xe9;
+
+		w25_select(dev);
+		w25_spitx(dev, sbuf, 1);
+		w25_deselect(dev);
+	}
+
+	return w25_getid(dev);
+}
+
+// read SFDP area with 0x5A command, it takes 8 dummy clocks
+static int w25_readsfdp(void *d, size_t addr, void *data, size_t sz)
+{
+	struct w25_device *dev;
+	uint8_t sbuf[5];
+
+	dev = (struct w25_device *) d;
+
+	sbuf[0] = 0x5a;
+	sbuf[1] = (addr >> 16) & 0xff;
+	sbuf[2] = (addr >> 8) & 0xff;
+	sbuf[3] = addr & 0xff;
+	sbuf[4] = 0x00;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 5);
+	w25_spirx(dev, data, sz);
+	w25_deselect(dev);
+
+	return 0;
+}
+
+// set SPI baud rate prescaler, Init field keeps the one, that SPI was
+// initialized with
+static void w25_setprescaler(SPI_HandleTypeDef *hspi, uint32_t br)
+{
+	__HAL_SPI_DISABLE(hspi);
+
+	hspi->Instance->CR1 = (hspi->Instance->CR1 & ~SPI_CR1_BR) | br;
+}
+
+// clock of the bus in Hz
+static uint32_t w25_clock(struct w25_device *dev)
+{
+	uint32_t pclk;
+
+	pclk = (dev->hspi->Instance == SPI1 || dev->hspi->Instance == SPI4)
+		? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+
+	return pclk >> ((dev->hspi->Instance->CR1 & SPI_CR1_BR)
+		/ SPI_CR1_BR_0 + 1);
+}
+
+// the slowest prescaler of calibrated chips on the bus
+static uint32_t w25_busprescaler(SPI_HandleTypeDef *hspi)
+{
+	uint32_t br;
+	int i;
+
+	br = SPI_BAUDRATEPRESCALER_2;
+
+	for (i = 0; i <= devcount; ++i) {
+		if (devs[i].hspi == hspi)
+			br = max(br, devs[i].prescaler);
+	}
+
+	return br;
+}
+
+// JEDEC ID, start of SFDP and start of the chip with 0x03 Read, that
+// takes 3-byte address on every chip after reset
+static void w25_calread(struct w25_device *dev, uint8_t *buf)
+{
+	uint8_t sbuf[4];
+	uint32_t id;
+
+	id = w25_getid(dev);
+
+	memmove(buf, &id, sizeof(uint32_t));
+
+	w25_readsfdp(dev, 0, buf + sizeof(uint32_t), W25_CALSIZE);
+
+	memset(sbuf, 0, sizeof(sbuf));
+	sbuf[0] = 0x03;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 4);
+	w25_spirx(dev, buf + sizeof(uint32_t) + W25_CALSIZE, W25_CALSIZE);
+	w25_deselect(dev);
+}
+
+// read passes, if JEDEC ID is the one found at init and SFDP starts
+// with its signature (if the chip has SFDP): erased chip or floating
+// MISO reads 0xff at any clock, so comparing with the read at the
+// initial clock alone passes them. The rest must match that read.
+static int w25_calcheck(struct w25_device *dev, const uint8_t *ref,
+	const uint8_t *buf, int sfdp)
+{
+	uint32_t id, sig;
+
+	memmove(&id, buf, sizeof(uint32_t));
+	memmove(&sig, buf + sizeof(uint32_t), sizeof(uint32_t));
+
+	if (id != dev->id || (sfdp && sig != SFDP_SIGNATURE))
+		return 0;
+
+	return (memcmp(buf, ref, sizeof(uint32_t) + 2 * W25_CALSIZE) == 0);
+}
+
+// find the fastest clock the chip reads reliably at, wiring differs
+// between boards, and use one step slower, so there is margin for
+// temperature and supply drift. Only reads are used, so flash content
+// is not touched.
+static void w25_calibrate(struct w25_device *dev)
+{
+	uint8_t ref[sizeof(uint32_t) + 2 * W25_CALSIZE];
+	uint8_t buf[sizeof(uint32_t) + 2 * W25_CALSIZE];
+	uint32_t br, sig;
+	int i, sfdp;
+
+	dev->prescaler = dev->hspi->Init.BaudRatePrescaler;
+
+	w25_setprescaler(dev->hspi, dev->prescaler);
+
+	// no chip answers
+	if (dev->id == 0 || dev->id == 0xffffff)
+		return;
+
+	w25_calread(dev, ref);
+
+	memmove(&sig, ref + sizeof(uint32_t), sizeof(uint32_t));
+	sfdp = (sig == SFDP_SIGNATURE);
+
+	// even the initial clock doesn't read ID found at init
+	if (!w25_calcheck(dev, ref, ref, sfdp))
+		return;
+
+	for (br = dev->prescaler; br > SPI_BAUDRATEPRESCALER_2; ) {
+		br -= SPI_CR1_BR_0;
+
+		w25_setprescaler(dev->hspi, br);
+
+		for (i = 0; i < W25_CALREPEAT; ++i) {
+			w25_calread(dev, buf);
+
+			if (!w25_calcheck(dev, ref, buf, sfdp))
+				break;
+		}
+
+		if (i < W25_CALREPEAT)
+			break;
+
+		dev->prescaler = br;
+	}
+
+	if (dev->prescaler < dev->hspi->Init.BaudRatePrescaler)
+		dev->prescaler += SPI_CR1_BR_0;
+
+	w25_setprescaler(dev->hspi, w25_busprescaler(dev->hspi));
+}
+
+// opcode taking 4-byte address, that replaces 3-byte address command
+// cmd, 0 if there is none. Separate opcodes are used instead of 4-byte
+// address mode (0xB7), so there is no mode to lose on chip reset.
+static uint8_t w25_opcode4(uint8_t cmd)
+{
+	switch (cmd) {
+	case 0x03:	return 0x13;
+	case 0x0b:	return 0x0c;
+	case 0x02:	return 0x12;
+	case 0x20:	return 0x21;
+	case 0xd8:	return 0xdc;
+	default:	return 0x00;
+	}
+}
+
+// command cmd with address addr, returns its length
+static int w25_header(struct w25_device *dev, uint8_t *sbuf, uint8_t cmd,
+	size_t addr)
+{
+	int n;
+
+	n = 0;
+
+	if (dev->addr4) {
+		sbuf[n++] = w25_opcode4(cmd);
+		sbuf[n++] = (addr >> 24) & 0xff;
+	} else
+		sbuf[n++] = cmd;
+
+	sbuf[n++] = (addr >> 16) & 0xff;
+	sbuf[n++] = (addr >> 8) & 0xff;
+	sbuf[n++] = addr & 0xff;
+
+	return n;
+}
+
+// density from the last byte of JEDEC ID: 0x11 (128kB) to 0x19
+// (32MB) are powers of two, 64MB and 128MB chips go on with 0x20
+// and 0x21. Returns 0 for unknown code.
+static size_t w25_capacity(uint32_t id)
+{
+	uint8_t code;
+
+	code = id & 0xff;
+
+	if (code >= 0x11 && code <= 0x19)
+		return (size_t) 1 << code;
+
+	if (code == 0x20)
+		return (size_t) 1 << 26;
+
+	if (code == 0x21)
+		return (size_t) 1 << 27;
+
+	return 0;
+}
+
+// fill device geometry from SFDP. Without it W25Q128 erase types
+// are used and density is taken from JEDEC ID. Fails on unknown
+// density code.
+static int w25_geometry(struct w25_device *dev)
+{
+	struct sfdp_info info;
+	int i, sector, addr4;
+
+	dev->pagesize = W25_PAGESIZE;
+	dev->programtime = W25_TPP;
+	dev->suspendcmd = 0x75;
+	dev->resumecmd = 0x7a;
+
+	memset(dev->erase, 0, sizeof(dev->erase));
+
+	dev->erase[0] = (struct sfdp_erasetype) {
+		W25_SECTORSIZE, 0x20, W25_TSE };
+	dev->erase[1] = (struct sfdp_erasetype) {
+		W25_HALFBLOCKSIZE, 0x52, W25_TBE32 };
+	dev->erase[2] = (struct sfdp_erasetype) {
+		W25_BLOCKSIZE, 0xd8, W25_TBE64 };
+
+	if ((dev->totalsize = w25_capacity(dev->id)) == 0)
+		return (-1);
+
+	// W25Q256 and bigger ones have 4-byte address commands
+	addr4 = 1;
+
+	if (sfdp_parse(w25_readsfdp, dev, &info) == 0) {
+		// the rest of driver expects 4kB sector erase
+		for (sector = 0, i = 0; i < SFDP_ERASETYPES; ++i) {
+			if (info.erase[i].size == W25_SECTORSIZE)
+				sector = 1;
+		}
+
+		if (sector && info.totalsize >= 2 * W25_BLOCKSIZE) {
+			dev->totalsize = info.totalsize;
+
+			if (info.pagesize <= W25_PAGESIZE)
+				dev->pagesize = info.pagesize;
+
+			if (info.programtime != 0)
+				dev->programtime = info.programtime;
+
+			dev->suspendcmd = info.suspendcmd;
+			dev->resumecmd = info.resumecmd;
+
+			memmove(dev->erase, info.erase, sizeof(dev->erase));
+
+			addr4 = info.addr4;
+		}
+	}
+
+	if (dev->totalsize > W25_ADDR3SIZE && !addr4)
+		dev->totalsize = W25_ADDR3SIZE;
+
+	// erase types without 4-byte address opcode (32kB block erase
+	// on W25Q256) can't reach the whole chip
+	dev->addr4 = (dev->totalsize > W25_ADDR3SIZE);
+
+	for (i = 0; i < SFDP_ERASETYPES && dev->addr4; ++i) {
+		if (w25_opcode4(dev->erase[i].opcode) == 0)
+			dev->erase[i].size = 0;
+	}
+
+	return 0;
+}
+
+// typical time of erase type of sz bytes
+static uint32_t w25_erasetime(struct w25_device *dev, size_t sz)
+{
+	int i;
+
+	for (i = 0; i < SFDP_ERASETYPES; ++i) {
+		if (dev->erase[i].size == sz)
+			return dev->erase[i].time;
+	}
+
+	return 0;
+}
+
+static int w25_writeenable(struct w25_device *dev)
+{
+	uint8_t sbuf[4];
+
+	sbuf[0] = 0x06;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_deselect(dev);
+
+	return 0;
+}
+
+static int w25_writedisable(struct w25_device *dev)
+{
+	uint8_t sbuf[4];
+
+	sbuf[0] = 0x04;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_deselect(dev);
+
+	return 0;
+}
+
+static uint8_t w25_readstatus(struct w25_device *dev)
+{
+	uint8_t sbuf[4], rbuf[4];
+
+	sbuf[0] = 0x05;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_spirx(dev, rbuf, 1);
+	w25_deselect(dev);
+
+	return rbuf[0];
+}
+
+static uint32_t w25_cycles(uint32_t us)
+{
+	return us * (SystemCoreClock / 1000000);
+}
+
+static int w25_polldue(struct w25_device *dev)
+{
+	return ((int32_t) (DWT->CYCCNT - dev->pollat) >= 0);
+}
+
+// program or erase, that takes typically us microseconds, was
+// started
+static void w25_startbusy(struct w25_device *dev, uint32_t us)
+{
+	dev->pollinterval = w25_cycles(max(us / W25_POLLDIV, W25_POLLMIN));
+	dev->pollat = DWT->CYCCNT + w25_cycles(us);
+	dev->busy = 1;
+}
+
+// send byte and receive the one, that comes back, through SPI
+// registers; waits end after W25_IRQTIMEOUT us from start
+static int w25_irqbyte(SPI_TypeDef *spi, uint8_t b, uint32_t start)
+{
+	uint32_t limit;
+
+	limit = w25_cycles(W25_IRQTIMEOUT);
+
+	while ((spi->SR & SPI_SR_TXE) == 0) {
+		if (DWT->CYCCNT - start > limit)
+			return (-1);
+	}
+
+	*((volatile uint8_t *) &spi->DR) = b;
+
+	while ((spi->SR & SPI_SR_RXNE) == 0) {
+		if (DWT->CYCCNT - start > limit)
+			return (-1);
+	}
+
+	return *((volatile uint8_t *) &spi->DR);
+}
+
+// one status read in SysTick interrupt. HAL_GetTick() doesn't advance
+// there, so HAL transfer timeout would never expire: registers are
+// used instead and waits are bounded by DWT cycles. Returns status
+// register or -1, if the transfer didn't finish in time.
+static int w25_irqstatus(struct w25_device *dev)
+{
+	SPI_TypeDef *spi;
+	uint32_t start;
+	int r;
+
+	spi = w25_spi(dev);
+
+	// drop byte and overrun left by transmit-only HAL transfer
+	(void) spi->DR;
+	(void) spi->SR;
+
+	start = DWT->CYCCNT;
+
+	w25_select(dev);
+
+	if ((r = w25_irqbyte(spi, 0x05, start)) >= 0)
+		r = w25_irqbyte(spi, 0xff, start);
+
+	while ((spi->SR & SPI_SR_BSY)
+		&& DWT->CYCCNT - start <= w25_cycles(W25_IRQTIMEOUT));
+
+	w25_deselect(dev);
+
+	return r;
+}
+
+// program or erase is found completed, possibly in interrupt
+static void w25_done(struct w25_device *dev)
+{
+	dev->busy = 0;
+
+	if (dev->done != NULL)
+		dev->done(dev->donearg);
+}
+
+// read status once, called from w25_waitwrite() and w25_suspend(). If
+// operation is done, busy is cleared. Returns 1 if device is still
+// busy. Interrupts stay enabled, so HAL timeouts run: w25_poll()
+// doesn't touch the bus while any chip on it is selected, so it can't
+// break into this transfer.
+static int w25_pollstatus(struct w25_device *dev)
+{
+	if (dev->busy && !dev->suspended) {
+		if (w25_readstatus(dev) & 0x01)
+			dev->pollat = DWT->CYCCNT + dev->pollinterval;
+		else
+			w25_done(dev);
+	}
+
+	return dev->busy;
+}
+
+// wait for program or erase to complete. Status is read in short
+// transactions, so between polls CS is high and the bus can be used
+// by other chip; if next poll is far, CPU sleeps until interrupt.
+static int w25_waitwrite(struct w25_device *dev)
+{
+	uint32_t start;
+
+	start = DWT->CYCCNT;
+
+	while (dev->busy) {
+		if (w25_polldue(dev))
+			w25_pollstatus(dev);
+		else if ((int32_t) (dev->pollat - DWT->CYCCNT)
+				> w25_cycles(1000))
+			__WFI();
+	}
+
+	dev->stat.busytime += (DWT->CYCCNT - start)
+		/ (SystemCoreClock / 1000000);
+
+	return 0;
+}
+
+// no chip on this SPI is selected by interrupted code
+static int w25_busfree(SPI_HandleTypeDef *hspi)
+{
+	int i;
+
+	if (hspi->State != HAL_SPI_STATE_READY)
+		return 0;
+
+	for (i = 0; i < devcount; ++i) {
+		if (devs[i].hspi == hspi
+				&& (devs[i].gpio->ODR & devs[i].pin) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+int w25_setcallback(void *d, void (*done)(void *arg), void *arg)
+{
+	struct w25_device *dev;
+
+	dev = (struct w25_device *) d;
+
+	dev->done = done;
+	dev->donearg = arg;
+
+	return 0;
+}
+
+static int w25_command(struct w25_device *dev, uint8_t cmd)
+{
+	w25_select(dev);
+	w25_spitx(dev, &cmd, 1);
+	w25_deselect(dev);
+
+	return 0;
+}
+
+static int w25_blockprotect(struct w25_device *dev, uint8_t flags)
+{
+	uint8_t sbuf[4];
+
+	sbuf[0] = 0x50;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 1);
+	w25_deselect(dev);
+
+	sbuf[0] = 0x01;
+	sbuf[1] = (flags & 0x0f) << 2;
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, 2);
+	w25_deselect(dev);
+
+	return 0;
+}
+
+// wait for program or erase left running and end it. Protection is
+// restored here, if no write session was started meanwhile.
+static void w25_finish(struct w25_device *dev)
+{
+	if (dev->pending == W25_NONE)
+		return;
+
+	w25_waitwrite(dev);
+	w25_writedisable(dev);
+
+	if (dev->unlocked == 0)
+		w25_blockprotect(dev, 0x0f);
+
+	dev->pending = W25_NONE;
+}
+
+// only status is read here, write disable and protection restore
+// are left to w25_idle(): they are HAL transfers with timeout
+void w25_poll()
+{
+	int i, sr;
+
+	for (i = 0; i < devcount; ++i) {
+		if (!devs[i].busy || devs[i].suspended
+				|| !w25_polldue(devs + i)
+				|| !w25_busfree(devs[i].hspi))
+			continue;
+
+		// bus didn't answer, try again on the next tick
+		if ((sr = w25_irqstatus(devs + i)) < 0)
+			continue;
+
+		if (sr & 0x01)
+			devs[i].pollat = DWT->CYCCNT + devs[i].pollinterval;
+		else
+			w25_done(devs + i);
+	}
+}
+
+// end operations, that w25_poll() found completed, so protection is
+// not left off until the next access
+void w25_idle()
+{
+	int i;
+
+	for (i = 0; i < devcount; ++i) {
+		if (!devs[i].busy && !devs[i].suspended
+				&& devs[i].pending != W25_NONE)
+			w25_finish(devs + i);
+	}
+}
+
+// running operation already has protection off
+static void w25_unlock(struct w25_device *dev)
+{
+	if (dev->unlocked++ == 0 && dev->pending == W25_NONE) {
+		w25_waitwrite(dev);
+		w25_blockprotect(dev, 0x00);
+	}
+}
+
+static void w25_lock(struct w25_device *dev)
+{
+	if (dev->unlocked > 0 && --dev->unlocked == 0
+			&& dev->pending == W25_NONE) {
+		w25_waitwrite(dev);
+		w25_blockprotect(dev, 0x0f);
+	}
+}
+
+// let read of sz bytes at addr go before running erase. Returns 1 if
+// erase was suspended, 0 if there is nothing to suspend or operation
+// was finished instead: if it's program, that is short, if it's the
+// erased area, that is read, or the chip can't suspend.
+static int w25_suspend(struct w25_device *dev, size_t addr, size_t sz)
+{
+	uint32_t gap;
+
+	if (dev->pending == W25_NONE)
+		return 0;
+
+	if (dev->pending == W25_PROGRAM || dev->suspendcmd == 0
+			|| (addr < dev->pendaddr + dev->pendsize
+			&& addr + sz > dev->pendaddr)) {
+		w25_finish(dev);
+		return 0;
+	}
+
+	if (!w25_pollstatus(dev)) {
+		w25_finish(dev);
+		return 0;
+	}
+
+	gap = w25_cycles(W25_TRS);
+	while (DWT->CYCCNT - dev->resumed < gap);
+
+	// busy bit clears, when erase is suspended, so polling must
+	// not take it for completion
+	dev->suspended = 1;
+
+	w25_command(dev, dev->suspendcmd);
+
+	while (w25_readstatus(dev) & 0x01);
+
+	dev->stat.suspends++;
+
+	return 1;
+}
+
+static void w25_resume(struct w25_device *dev)
+{
+	w25_command(dev, dev->resumecmd);
+
+	dev->resumed = DWT->CYCCNT;
+	dev->pollat = dev->resumed + dev->pollinterval;
+	dev->suspended = 0;
+}
+
+// total size of iovcnt pieces
+static size_t w25_iovsize(const struct bdev_iovec *iov, int iovcnt)
+{
+	size_t sz;
+	int i;
 
-static int w25_getid(struct w25_device *dev)
+	sz = 0;
+	for (i = 0; i < iovcnt; ++i)
+		sz += iov[i].len;
+
+	return sz;
+}
+
+// pieces are received one after another with chip selected, each of
+// them with its own DMA transfer, there is no DMA descriptor chaining
+// on this MCU
+int w25_readv(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
 {
-	uint8_t sbuf[4], rbuf[4];
+	struct w25_device *dev;
+	uint8_t sbuf[6];
+	size_t sz;
+	int cmdsz, suspended, i, r;
 
-	sbuf[0] = 0x9f;
+	dev = (struct w25_device *) d;
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
-	HAL_SPI_Receive(dev->hspi, rbuf, 3, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	sz = w25_iovsize(iov, iovcnt);
 
-	return ((rbuf[0] << 16) | (rbuf[1] << 8) | rbuf[2]);
+	TRACE_ENTER(TRACE_W25READ, dev - devs, addr, sz);
+
+	suspended = w25_suspend(dev, addr, sz);
+
+	// fast read is followed by 8 dummy clocks
+	if (dev->readmode == W25_FASTREAD) {
+		cmdsz = w25_header(dev, sbuf, 0x0b, addr);
+		sbuf[cmdsz++] = 0x00;
+	} else
+		cmdsz = w25_header(dev, sbuf, 0x03, addr);
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, cmdsz);
+
+	for (i = 0, r = 0; i < iovcnt && r == 0; ++i)
+		r = w25_receive(dev, iov[i].base, iov[i].len);
+
+	w25_deselect(dev);
+
+	// read can be repeated from the start, so if DMA failed,
+	// do it again by polling
+	if (r < 0) {
+		w25_select(dev);
+		w25_spitx(dev, sbuf, cmdsz);
+
+		for (i = 0; i < iovcnt; ++i)
+			w25_spirx(dev, iov[i].base, iov[i].len);
+
+		w25_deselect(dev);
+	}
+
+	if (suspended)
+		w25_resume(dev);
+
+	dev->stat.reads++;
+	dev->stat.readbytes += sz;
+
+	TRACE_LEAVE(TRACE_W25READ, dev - devs, addr, sz);
+
+	return 0;
 }
 
-static int w25_init(struct w25_device *dev)
+int w25_read(void *d, size_t addr, void *data, size_t sz)
 {
-	uint8_t sbuf[4];
+	struct bdev_iovec iov;
 
-	HAL_Delay(100);
+	iov.base = data;
+	iov.len = sz;
 
-	sbuf[0] = 0x66;
-	sbuf[1] = 0x99;
+	return w25_readv(d, addr, &iov, 1);
+}
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 2, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+// start program of iovcnt pieces at addr and leave it running, chip
+// must be idle and not protected
+static int w25_programv(struct w25_device *dev, size_t addr,
+	const struct bdev_iovec *iov, int iovcnt)
+{
+	uint8_t sbuf[5];
+	size_t sz;
+	int i, r;
 
-	HAL_Delay(100);
+	sz = w25_iovsize(iov, iovcnt);
 
-	return w25_getid(dev);
+	// area before the table isn't all erased anymore
+	if (addr < dev->wearstart)
+		dev->wearerased = 0;
+
+	w25_writeenable(dev);
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, w25_header(dev, sbuf, 0x02, addr));
+
+	for (i = 0, r = 0; i < iovcnt && r == 0; ++i)
+		r = w25_transmit(dev, iov[i].base, iov[i].len);
+
+	w25_deselect(dev);
+
+	w25_startbusy(dev, dev->programtime);
+
+	dev->pending = W25_PROGRAM;
+	dev->pendaddr = addr;
+	dev->pendsize = sz;
+
+	dev->stat.programs++;
+	dev->stat.programbytes += sz;
+
+	return r;
 }
 
-static int w25_writeenable(struct w25_device *dev)
+static int w25_program(struct w25_device *dev, size_t addr,
+	const void *data, size_t sz)
 {
-	uint8_t sbuf[4];
+	struct bdev_iovec iov;
 
-	sbuf[0] = 0x06;
+	iov.base = (void *) data;
+	iov.len = sz;
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	return w25_programv(dev, addr, &iov, 1);
+}
 
-	return 0;
+int w25_writev(void *d, size_t addr, const struct bdev_iovec *iov,
+	int iovcnt)
+{
+	struct w25_device *dev;
+	size_t sz;
+	int r;
+	
+	dev = (struct w25_device *) d;
+
+	sz = w25_iovsize(iov, iovcnt);
+
+	TRACE_ENTER(TRACE_W25WRITE, dev - devs, addr, sz);
+
+	// every started operation is pending, so after it's finished
+	// the chip is idle
+	w25_finish(dev);
+
+	if (dev->unlocked == 0)
+		w25_blockprotect(dev, 0x00);
+
+	r = w25_programv(dev, addr, iov, iovcnt);
+
+	TRACE_LEAVE(TRACE_W25WRITE, dev - devs, addr, sz);
+
+	// page is already programmed with what was sent before the
+	// failure, so it can't be just sent again
+	return r;
 }
 
-static int w25_writedisable(struct w25_device *dev)
+int w25_write(void *d, size_t addr, const void *data, size_t sz)
 {
-	uint8_t sbuf[4];
+	struct bdev_iovec iov;
 
-	sbuf[0] = 0x04;
+	iov.base = (void *) data;
+	iov.len = sz;
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	return w25_writev(d, addr, &iov, 1);
+}
+
+// erase sz bytes at addr with cmd, it's left running like program
+// and ended by w25_finish() before next program or erase, or by read
+// of erased area
+static int w25_erase(struct w25_device *dev, uint8_t cmd, size_t addr,
+	size_t sz)
+{
+	uint8_t sbuf[5];
+
+	w25_finish(dev);
+
+	if (dev->unlocked == 0)
+		w25_blockprotect(dev, 0x00);
+
+	w25_writeenable(dev);
+
+	w25_select(dev);
+	w25_spitx(dev, sbuf, w25_header(dev, sbuf, cmd, addr));
+	w25_deselect(dev);
+
+	w25_startbusy(dev, w25_erasetime(dev, sz));
+
+	dev->pending = W25_ERASE;
+	dev->pendaddr = addr;
+	dev->pendsize = sz;
+	dev->resumed = DWT->CYCCNT;
 
 	return 0;
 }
 
-static int w25_waitwrite(struct w25_device *dev)
+static size_t w25_wearcopyaddr(struct w25_device *dev, int c)
 {
-	uint8_t sbuf[4], rbuf[4];
+	return dev->wearstart + c * (dev->totalsize - dev->wearstart) / 2;
+}
 
-	sbuf[0] = 0x05;
+// reserve as many last 64kB blocks, as needed for two copies of
+// table, so the rest still can be erased with whole blocks
+static void w25_wearlayout(struct w25_device *dev)
+{
+	size_t wearsize;
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
+	wearsize = W25_BLOCKSIZE;
+
+	while (W25_WEARTABLESIZE((dev->totalsize - wearsize) / W25_SECTORSIZE)
+			> wearsize / 2)
+		wearsize += W25_BLOCKSIZE;
 
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
+	dev->wearstart = dev->totalsize - wearsize;
+	dev->wearsectors = dev->wearstart / W25_SECTORSIZE;
+}
+
+static int w25_wearinit(struct w25_device *dev)
+{
+	uint32_t hdr[W25_WEARHEADER];
+	int c;
 
-	do {
-		HAL_SPI_Receive(dev->hspi, rbuf, 1, 5000);
-	} while ((rbuf[0] & 0x01) == 0x01);
+	w25_wearlayout(dev);
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	dev->wearon = 0;
+	dev->wearerased = 0;
+	dev->wearslots = 0;
+	dev->wearcopy = -1;
+	dev->wearseq = 0;
+	dev->wearpending = 0;
+
+	// copy without magic was never completely written or the area
+	// still belongs to filesystem formatted over the whole chip
+	for (c = 0; c < 2; ++c) {
+		w25_read(dev, w25_wearcopyaddr(dev, c), hdr, sizeof(hdr));
+
+		if (hdr[0] != W25_WEARMAGIC)
+			continue;
+
+		if (dev->wearcopy < 0 || hdr[1] > dev->wearseq) {
+			dev->wearcopy = c;
+			dev->wearseq = hdr[1];
+		}
+	}
+
+	dev->wearon = (dev->wearcopy >= 0);
 
 	return 0;
 }
 
-static int w25_blockprotect(struct w25_device *dev, uint8_t flags)
+// Add RAM counters to persisted table by writing the table's
+// other copy. Header page with sequence number is written last,
+// so if sync is interrupted, previous copy stays valid.
+static int w25_wearsync(struct w25_device *dev)
 {
-	uint8_t sbuf[4];
+	uint32_t buf[W25_PAGESIZE / sizeof(uint32_t)];
+	size_t dst, src, off, tablesize, i, w;
+	int c;
 
-	sbuf[0] = 0x50;
+	if (!dev->wearon)
+		return (-1);
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	c = (dev->wearcopy == 0) ? 1 : 0;
 
-	sbuf[0] = 0x01;
-	sbuf[1] = (flags & 0x0f) << 2;
+	dst = w25_wearcopyaddr(dev, c);
+	src = w25_wearcopyaddr(dev, dev->wearcopy);
+	tablesize = W25_WEARTABLESIZE(dev->wearsectors);
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 2, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	for (off = 0; off < tablesize; off += W25_SECTORSIZE)
+		w25_erase(dev, 0x20, dst + off, W25_SECTORSIZE);
+
+	off = (tablesize - 1) / dev->pagesize * dev->pagesize;
+	while (1) {
+		if (dev->wearcopy >= 0)
+			w25_read(dev, src + off, buf, dev->pagesize);
+		else
+			memset(buf, 0xff, dev->pagesize);
+
+		for (i = 0; i < dev->pagesize / sizeof(uint32_t); ++i) {
+			w = off / sizeof(uint32_t) + i;
+
+			if (w == 0)
+				buf[i] = W25_WEARMAGIC;
+			else if (w == 1)
+				buf[i] = dev->wearseq + 1;
+			else if (w < W25_WEARHEADER + dev->wearsectors
+					&& buf[i] == 0xffffffff)
+				buf[i] = 0;
+		}
+
+		for (i = 0; i < dev->wearslots; ++i) {
+			w = (dev->wear[i].sector + W25_WEARHEADER)
+				* sizeof(uint32_t);
+
+			if (w >= off && w < off + dev->pagesize) {
+				buf[(w - off) / sizeof(uint32_t)]
+					+= dev->wear[i].count;
+			}
+		}
+
+		w25_write(dev, dst + off, buf, dev->pagesize);
+
+		if (off == 0)
+			break;
+
+		off -= dev->pagesize;
+	}
+
+	dev->wearcopy = c;
+	dev->wearseq++;
+	dev->wearpending = 0;
+	dev->wearslots = 0;
 
 	return 0;
 }
 
-int w25_read(void *d, size_t addr, void *data, size_t sz)
+// everything before the table is erased, so no filesystem refers to
+// the reserved area anymore and the table can be created there; the
+// other copy's header is erased, so old data isn't taken for it
+static int w25_wearcreate(struct w25_device *dev)
 {
-	struct w25_device *dev;
-	uint8_t sbuf[4];
+	w25_erase(dev, 0x20, w25_wearcopyaddr(dev, 1), W25_SECTORSIZE);
 
-	dev = (struct w25_device *) d;
+	dev->wearon = 1;
+	dev->wearcopy = -1;
+	dev->wearseq = 0;
+	dev->wearslots = 0;
 
-	sbuf[0] = 0x03;
-	sbuf[1] = (addr >> 16) & 0xff;
-	sbuf[2] = (addr >> 8) & 0xff;
-	sbuf[3] = addr & 0xff;
+	return w25_wearsync(dev);
+}
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 4, 5000);
-	HAL_SPI_Receive(dev->hspi, data, sz, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+// slot of sector's RAM counter, or -1
+static int w25_wearslot(struct w25_device *dev, size_t sector)
+{
+	int i;
 
-	return 0;
+	for (i = 0; i < dev->wearslots; ++i) {
+		if (dev->wear[i].sector == sector)
+			return i;
+	}
+
+	return (-1);
 }
 
-int w25_write(void *d, size_t addr, const void *data, size_t sz)
+static int w25_wearcount(struct w25_device *dev, size_t sector)
 {
-	struct w25_device *dev;
-	uint8_t sbuf[4];
-	
-	dev = (struct w25_device *) d;
+	int i;
 
-	w25_waitwrite(dev);
+	if (!dev->wearon || sector >= dev->wearsectors)
+		return 0;
 
-	w25_blockprotect(dev, 0x00);
-	w25_writeenable(dev);
+	if ((i = w25_wearslot(dev, sector)) < 0) {
+		if (dev->wearslots == W25_WEARSLOTS)
+			w25_wearsync(dev);
 
-	sbuf[0] = 0x02;
-	sbuf[1] = (addr >> 16) & 0xff;
-	sbuf[2] = (addr >> 8) & 0xff;
-	sbuf[3] = addr & 0xff;
+		i = dev->wearslots++;
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 4, 5000);
-	HAL_SPI_Transmit(dev->hspi, (uint8_t  *) data, sz, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+		dev->wear[i].sector = sector;
+		dev->wear[i].count = 0;
+	}
 
-	w25_waitwrite(dev);
-	w25_writedisable(dev);
-	w25_blockprotect(dev, 0x0f);
+	dev->wear[i].count++;
+
+	if (++dev->wearpending >= W25_WEARSYNCPERIOD)
+		w25_wearsync(dev);
 
 	return 0;
 }
 
-int w25_eraseall(void *d)
+static uint32_t w25_erasecount(struct w25_device *dev, size_t sector)
+{
+	uint32_t cnt;
+	int i;
+
+	cnt = 0;
+
+	w25_read(dev, w25_wearcopyaddr(dev, dev->wearcopy)
+		+ (sector + W25_WEARHEADER) * sizeof(uint32_t),
+		&cnt, sizeof(uint32_t));
+
+	if (cnt == 0xffffffff)
+		cnt = 0;
+
+	if ((i = w25_wearslot(dev, sector)) >= 0)
+		cnt += dev->wear[i].count;
+
+	return cnt;
+}
+
+int w25_eraserange(void *d, size_t addr, size_t sz)
 {
 	struct w25_device *dev;
-	uint8_t sbuf[4];
-	
+	struct sfdp_erasetype *e;
+	size_t a, end, n, s;
+	int i, r;
+
 	dev = (struct w25_device *) d;
 
-	w25_waitwrite(dev);
-	w25_blockprotect(dev, 0x00);
-	w25_writeenable(dev);
+	if (addr % W25_SECTORSIZE || sz % W25_SECTORSIZE
+			|| addr + sz > dev->wearstart)
+		return (-1);
 
-	sbuf[0] = 0xc7;
+	TRACE_ENTER(TRACE_W25ERASERANGE, dev - devs, addr, sz);
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 1, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	w25_unlock(dev);
 
-	w25_waitwrite(dev);
-	w25_writedisable(dev);
-	w25_blockprotect(dev, 0x0f);
+	r = 0;
 
-	return 0;
+	for (a = addr, end = addr + sz; a < end; a += n) {
+		// largest erase type aligned to address and not
+		// bigger than the rest of range, there is none, if
+		// 4kB type is missing
+		for (e = NULL, i = 0; i < SFDP_ERASETYPES; ++i) {
+			n = dev->erase[i].size;
+
+			if (n == 0 || a % n != 0 || end - a < n)
+				continue;
+
+			if (e == NULL || n > e->size)
+				e = dev->erase + i;
+		}
+
+		if (e == NULL) {
+			r = -1;
+			break;
+		}
+
+		n = e->size;
+
+		if ((r = w25_erase(dev, e->opcode, a, n)) < 0)
+			break;
+
+		if (n == W25_SECTORSIZE)
+			dev->stat.erases++;
+		else
+			dev->stat.blockerases++;
+
+		for (s = a; s < a + n; s += W25_SECTORSIZE)
+			w25_wearcount(dev, s / W25_SECTORSIZE);
+	}
+
+	if (r == 0 && !dev->wearon && addr <= dev->wearerased) {
+		dev->wearerased = max(dev->wearerased, addr + sz);
+
+		if (dev->wearerased >= dev->wearstart)
+			w25_wearcreate(dev);
+	}
+
+	w25_lock(dev);
+
+	TRACE_LEAVE(TRACE_W25ERASERANGE, dev - devs, addr, sz);
+
+	return r;
+}
+
+// Chip erase command would also erase wear table, so everything
+// before it is erased with 64kB blocks instead.
+int w25_eraseall(void *d)
+{
+	struct w25_device *dev;
+	int r;
+
+	dev = (struct w25_device *) d;
+
+	// counted as block erases by w25_eraserange(), chip erase
+	// command is never sent
+	r = w25_eraserange(dev, 0, dev->wearstart);
+
+	return r;
 }
 
 int w25_erasesector(void *d, size_t addr)
 {
 	struct w25_device *dev;
-	uint8_t sbuf[4];
-	
+	int r;
+
 	dev = (struct w25_device *) d;
 
-	w25_waitwrite(dev);
-	w25_blockprotect(dev, 0x00);
-	w25_writeenable(dev);
+	// once the table is created, the area is reserved; before that
+	// it can still belong to filesystem formatted over whole chip
+	if (dev->wearon && addr >= dev->wearstart)
+		return (-1);
 
-	sbuf[0] = 0x20;
-	sbuf[1] = (addr >> 16) & 0xff;
-	sbuf[2] = (addr >> 8) & 0xff;
-	sbuf[3] = addr & 0xff;
+	TRACE_ENTER(TRACE_W25ERASESECTOR, dev - devs, addr, W25_SECTORSIZE);
 
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_RESET);
-	HAL_SPI_Transmit(dev->hspi, sbuf, 4, 5000);
-	HAL_GPIO_WritePin(dev->gpio, dev->pin, GPIO_PIN_SET);
+	r = w25_erase(dev, 0x20, addr, W25_SECTORSIZE);
 
-	w25_waitwrite(dev);
-	w25_writedisable(dev);
-	w25_blockprotect(dev, 0x0f);
+	dev->stat.erases++;
 
-	return 0;
+	w25_wearcount(dev, addr / W25_SECTORSIZE);
+
+	TRACE_LEAVE(TRACE_W25ERASESECTOR, dev - devs, addr, W25_SECTORSIZE);
+
+	return r;
 }
 
+// pages are programmed in one write session, so protection is not
+// set and removed around every page. Next page is sent as soon as
+// the previous one is done: its write enable was cleared by the chip
+// and protection is off, so there is nothing to end. Chip ignores
+// commands while it programs, so the transfer of the next page can't
+// overlap the program of the previous one.
 int w25_writesector(void *d, size_t addr, const void *data,
 	size_t sz)
 {
 	struct w25_device *dev;
-	int i;
+	size_t n;
+	int i, r;
 	
 	dev = (struct w25_device *) d;
 
-	for (i = 0; i < sz; i += min(W25_PAGESIZE, sz - i))
-		w25_write(dev, addr + i, data + i, W25_PAGESIZE);
+	w25_finish(dev);
+	w25_unlock(dev);
+
+	r = 0;
+
+	for (i = 0; i < sz; i += n) {
+		n = min(dev->pagesize, sz - i);
+
+		TRACE_ENTER(TRACE_W25WRITE, dev - devs, addr + i, n);
+
+		w25_waitwrite(dev);
+
+		// done before the next command, so w25_poll() doesn't
+		// end it between write enable and program
+		dev->pending = W25_NONE;
+
+		r = w25_program(dev, addr + i, data + i, n);
+
+		TRACE_LEAVE(TRACE_W25WRITE, dev - devs, addr + i, n);
+
+		if (r < 0)
+			break;
+	}
+
+	w25_lock(dev);
+
+	return r;
+}
+
+int w25_spitime(void *d, uint32_t count, uint32_t *status,
+	uint32_t *read)
+{
+	struct w25_device *dev;
+	uint8_t buf[W25_SPITIMEREAD];
+	uint32_t i, start;
+
+	dev = (struct w25_device *) d;
+
+	if (count == 0)
+		return (-1);
+
+	w25_finish(dev);
+
+	start = DWT->CYCCNT;
+
+	for (i = 0; i < count; ++i)
+		w25_readstatus(dev);
+
+	*status = (DWT->CYCCNT - start) / count;
+
+	start = DWT->CYCCNT;
+
+	for (i = 0; i < count; ++i)
+		w25_read(dev, 0, buf, sizeof(buf));
+
+	*read = (DWT->CYCCNT - start) / count;
 
 	return 0;
 }
 
 int w25_ioctl(void *d, int req, ...)
 {
-	return 0;
+	struct w25_device *dev;
+	va_list args;
+	int r;
+
+	dev = (struct w25_device *) d;
+
+	va_start(args, req);
+
+	r = 0;
+
+	switch (req) {
+	case BDEV_GETSTAT:
+		memmove(va_arg(args, struct bdevstat *), &(dev->stat),
+			sizeof(struct bdevstat));
+		break;
+
+	case BDEV_RESETSTAT:
+		memset(&(dev->stat), 0, sizeof(struct bdevstat));
+		break;
+
+	case BDEV_BADREAD:
+		dev->stat.retries++;
+		break;
+
+	case BDEV_GETERASECOUNT:
+		{
+			size_t s;
+			uint32_t *cnt;
+
+			s = va_arg(args, size_t) / W25_SECTORSIZE;
+			cnt = va_arg(args, uint32_t *);
+
+			if (!dev->wearon) {
+				r = -1;
+				break;
+			}
+
+			*cnt = (s < dev->wearsectors)
+				? w25_erasecount(dev, s) : 0;
+		}
+		break;
+
+	case BDEV_SYNCWEAR:
+		r = w25_wearsync(dev);
+		w25_finish(dev);
+		break;
+
+	case BDEV_UNLOCK:
+		w25_unlock(dev);
+		break;
+
+	case BDEV_LOCK:
+		w25_lock(dev);
+		break;
+
+	case BDEV_BUSY:
+		r = (dev->pending != W25_NONE && w25_pollstatus(dev));
+		break;
+
+	case BDEV_GETCLOCK:
+		*(va_arg(args, uint32_t *)) = w25_clock(dev);
+		break;
+
+	default:
+		r = -1;
+	}
+
+	va_end(args);
+
+	return r;
 }
 
 int initdevice(void *is, struct bdevice *dev)
 {
+	if (devcount >= W25_MAXDEVS)
+		return (-1);
+
 	memmove(devs + devcount, is, sizeof(struct w25_device));
-	
+	memset(&(devs[devcount].stat), 0, sizeof(struct bdevstat));
+	devs[devcount].dmabusy = 0;
+	devs[devcount].unlocked = 0;
+	devs[devcount].pending = W25_NONE;
+	devs[devcount].busy = 0;
+	devs[devcount].suspended = 0;
+	devs[devcount].done = NULL;
+
+	// HAL SPI has only one data line in each direction, dual and
+	// quad output reads need QSPI peripheral
+	if (devs[devcount].readmode > W25_FASTREAD)
+		devs[devcount].readmode = W25_FASTREAD;
+
+	devs[devcount].id = w25_init(devs + devcount);
+
+	// nothing answers at this chip select, bus floats high or low
+	if (devs[devcount].id == 0x000000 || devs[devcount].id == 0xffffff)
+		return (-1);
+
+	w25_calibrate(devs + devcount);
+
+	if (w25_geometry(devs + devcount) < 0)
+		return (-1);
+	w25_wearinit(devs + devcount);
+
 	sprintf(dev->name, "%s%d", "flash", devcount);
 
 	dev->priv = devs + devcount;
@@ -239,13 +1594,16 @@ int initdevice(void *is, struct bdevice *dev)
 	dev->ioctl = w25_ioctl;
 	dev->eraseall = w25_eraseall;
 	dev->erasesector = w25_erasesector;
+	dev->eraserange = w25_eraserange;
 	dev->writesector = w25_writesector;
+	dev->readv = w25_readv;
+	dev->writev = w25_writev;
 
-	dev->writesize = W25_PAGESIZE;
+	dev->writesize = devs[devcount].pagesize;
 	dev->sectorsize = W25_SECTORSIZE;
-	dev->totalsize = W25_TOTALSIZE;
-
-	w25_init(devs + devcount);
+	dev->totalsize = devs[devcount].wearstart;
+	dev->programtime = devs[devcount].programtime;
+	dev->erasetime = w25_erasetime(devs + devcount, W25_SECTORSIZE);
 
 	devcount++;
 
@@ -2,20 +2,168 @@
 #define W25_H
 
 #include "driver.h"
+#include "sfdp.h"
 
+// Geometry of W25Q128, used when device has no valid SFDP. Page
+// size from SFDP can only be smaller and erase types must include
+// 4kB sector erase.
 #define W25_PAGESIZE 256
 #define W25_SECTORSIZE 4096
+#define W25_HALFBLOCKSIZE (4096 * 8)
 #define W25_BLOCKSIZE (4096 * 16)
 #define W25_TOTALSIZE (1024 * 1024 * 16)
 
+// typical W25Q128JV times in us
+#define W25_TPP 400
+#define W25_TSE 45000
+#define W25_TBE32 120000
+#define W25_TBE64 150000
+
+// erase has to run at least that long after resume, before it can
+// be suspended again, us
+#define W25_TRS 20
+
+// 3-byte address reaches only first 16MB, bigger chips are accessed
+// with 4-byte address commands
+#define W25_ADDR3SIZE (1024 * 1024 * 16)
+
 #define W25_MAXDEVS 4
 
+// SPI clock calibration at init: clock is raised step by step while
+// JEDEC ID and the first W25_CALSIZE bytes of SFDP and of the chip
+// read W25_CALREPEAT times in a row are the same as at the clock SPI
+// was initialized with, ID is the one found at init and SFDP has its
+// signature; then it's lowered one step back
+#define W25_CALSIZE 64
+#define W25_CALREPEAT 8
+
+// Last 64kB blocks (one for chips up to 32MB) are reserved for two
+// copies of erase counters table: W25_WEARMAGIC and sequence number
+// followed by 32-bit counter for every sector before them. Table is
+// used only if one of copies has W25_WEARMAGIC, it's created when
+// everything before it is erased, like by filesystem format, so image
+// formatted without the reserved area is left as it is. Erases of up
+// to W25_WEARSLOTS sectors are counted in RAM and added to the table
+// every W25_WEARSYNCPERIOD erases or when erased sector has no slot.
+#define W25_WEARMAGIC 0x77656172
+#define W25_WEARHEADER 2
+#define W25_WEARTABLESIZE(sectors) \
+	(((sectors) + W25_WEARHEADER) * sizeof(uint32_t))
+#define W25_WEARSYNCPERIOD 1024
+#define W25_WEARSLOTS 32
+
+// read commands: 0x03 Read (up to 50 MHz), 0x0b Fast Read with dummy
+// byte, 0x3b/0x6b Dual/Quad Output Fast Read, that need 2 or 4 data
+// lines wired
+enum W25_READMODE {
+	W25_READ		= 0x00,
+	W25_FASTREAD		= 0x01,
+	W25_DUALREAD		= 0x02,
+	W25_QUADREAD		= 0x03
+};
+
+// erases of sector, not yet added to the table
+struct w25_wearslot {
+	uint32_t sector;
+	uint32_t count;
+};
+
+// operation left running on the chip, it's waited for by next access
+enum W25_PENDING {
+	W25_NONE		= 0x00,
+	W25_PROGRAM		= 0x01,
+	W25_ERASE		= 0x02
+};
+
 struct w25_device {
 	SPI_HandleTypeDef *hspi;
 	GPIO_TypeDef *gpio;
 	uint16_t pin;
+
+	// requested read mode, lowered at initdevice to what the bus
+	// can do
+	enum W25_READMODE readmode;
+
+	struct bdevstat stat;
+
+	// cleared by SPI DMA completion callback
+	volatile int dmabusy;
+
+	// depth of BDEV_UNLOCK sessions, block protection is off
+	// while it's not 0
+	int unlocked;
+
+	// geometry from SFDP, or defaults
+	uint32_t id;
+	size_t totalsize;
+	size_t pagesize;
+	struct sfdp_erasetype erase[SFDP_ERASETYPES];
+	uint32_t programtime;
+
+	// commands take 4-byte address, chip is bigger than 16MB
+	int addr4;
+
+	// the fastest reliable SPI prescaler of the chip, found at
+	// init; bus runs with the slowest prescaler of chips on it
+	uint32_t prescaler;
+
+	// erase suspend and resume commands, 0 if not supported
+	uint8_t suspendcmd;
+	uint8_t resumecmd;
+
+	// program or erase is left running after its command is sent,
+	// so the other chip on the bus can be accessed meanwhile; reads
+	// of other addresses suspend erase. DWT cycle of the last resume.
+	enum W25_PENDING pending;
+	size_t pendaddr;
+	size_t pendsize;
+	uint32_t resumed;
+
+	// program or erase is in progress, cleared when status poll
+	// finds it done, from w25_waitwrite() or w25_poll(); DWT cycle
+	// of the next poll and interval between polls
+	volatile int busy;
+	volatile int suspended;
+	uint32_t pollat;
+	uint32_t pollinterval;
+
+	// called when program or erase completes, possibly from
+	// interrupt
+	void (*done)(void *arg);
+	void *donearg;
+
+	size_t wearstart;
+	size_t wearsectors;
+
+	// table is in use; before that, end of area erased from address
+	// 0 without programs in between
+	int wearon;
+	size_t wearerased;
+
+	struct w25_wearslot wear[W25_WEARSLOTS];
+	int wearslots;
+	int wearcopy;
+	uint32_t wearseq;
+	uint32_t wearpending;
 };
 
 int w25_getdriver(struct driver *driver);
 
+// polls status of busy devices, whose bus is free, called from
+// SysTick interrupt
+void w25_poll();
+
+// ends operations, that w25_poll() found completed: disables write
+// and restores protection, called from thread while driver is idle
+void w25_idle();
+
+int w25_setcallback(void *d, void (*done)(void *arg), void *arg);
+
+// average DWT cycles of status read and of W25_SPITIMEREAD bytes read
+// over count runs, to compare builds with and without W25_LLSPI
+#define W25_SPITIMEREAD 16
+
+int w25_spitime(void *d, uint32_t count, uint32_t *status,
+	uint32_t *read);
+
 #endif